@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "zmalloc.h"
+#include "cJSON.h"
+#include "arena.h"
+
+/* Allocations larger than a quarter of a block go to the heap, so one
+ * large request body does not leave every thread holding large blocks */
+#define ARENA_HEAP_RATIO    4
+#define ARENA_ALIGN(n)      (((n) + 15) & ~(size_t)15)
+
+/* Header of every allocation, 16 bytes so the memory that follows
+ * stays aligned for any type */
+typedef struct Khdr {
+    size_t size;            /* Usable size */
+    size_t arena;           /* Set if taken from an arena */
+} Khdr;
+
+typedef struct Kblock {
+    struct Kblock *next;    /* Previous block */
+    size_t used;
+    size_t size;
+} Kblock;
+
+#define BLOCK_DATA(b)       ((char *)(b) + ARENA_ALIGN(sizeof(Kblock)))
+
+typedef struct Karena {
+    Kblock *head;           /* Block allocations are taken from */
+    Kblock *first;          /* Oldest block, kept across requests */
+    Khdr *last;             /* Latest allocation, resized or given back in place */
+    int active;
+} Karena;
+
+static size_t arena_size = 0;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static __thread Karena *thread_arena = NULL;
+
+static void kx_arena_release(void *ptr) {
+    Karena *a = ptr;
+    Kblock *b;
+
+    while ((b = a->head) != NULL) {
+        a->head = b->next;
+        zfree(b);
+    }
+    zfree(a);
+}
+
+static void kx_arena_key(void) {
+    pthread_key_create(&arena_key, kx_arena_release);
+}
+
+static Kblock *kx_block_new(Kblock *next) {
+    Kblock *b = zmalloc(ARENA_ALIGN(sizeof(Kblock)) + arena_size);
+
+    b->next = next;
+    b->used = 0;
+    b->size = arena_size;
+    return b;
+}
+
+void kx_arena_init(size_t size) {
+    cJSON_Hooks hooks = {kx_arena_malloc, kx_arena_free};
+
+    arena_size = ARENA_ALIGN(size);
+    cJSON_InitHooks(&hooks);
+}
+
+void kx_arena_begin(void) {
+    Karena *a = thread_arena;
+
+    if (arena_size == 0)
+        return;
+    if (a == NULL) {
+        pthread_once(&arena_once, kx_arena_key);
+        a = zcalloc(sizeof(Karena));
+        a->head = a->first = kx_block_new(NULL);
+        thread_arena = a;
+        pthread_setspecific(arena_key, a);
+    }
+    a->active = 1;
+}
+
+void kx_arena_end(void) {
+    Karena *a = thread_arena;
+    Kblock *b;
+
+    if (a == NULL)
+        return;
+    while (a->head != a->first) {
+        b = a->head;
+        a->head = b->next;
+        zfree(b);
+    }
+    a->first->used = 0;
+    a->last = NULL;
+    a->active = 0;
+}
+
+int kx_arena_pause(void) {
+    Karena *a = thread_arena;
+    int state = a && a->active;
+
+    if (a)
+        a->active = 0;
+    return state;
+}
+
+void kx_arena_resume(int state) {
+    if (state)
+        thread_arena->active = 1;
+}
+
+static int kx_arena_fits(size_t size) {
+    Karena *a = thread_arena;
+    return a && a->active && size <= arena_size / ARENA_HEAP_RATIO;
+}
+
+void *kx_arena_malloc(size_t size) {
+    Karena *a = thread_arena;
+    size_t need = ARENA_ALIGN(sizeof(Khdr) + size);
+    Khdr *h;
+
+    if (kx_arena_fits(size)) {
+        if (a->head->used + need > a->head->size)
+            a->head = kx_block_new(a->head);
+        h = (Khdr *)(BLOCK_DATA(a->head) + a->head->used);
+        a->head->used += need;
+        h->arena = 1;
+        a->last = h;
+    } else {
+        h = zmalloc(sizeof(Khdr) + size);
+        h->arena = 0;
+    }
+    h->size = size;
+    return h + 1;
+}
+
+void kx_arena_free(void *ptr) {
+    Karena *a = thread_arena;
+    Khdr *h;
+
+    if (ptr == NULL)
+        return;
+    h = (Khdr *)ptr - 1;
+    if (!h->arena) {
+        zfree(h);
+        return;
+    }
+    /* Arena memory is released with the request, only the latest
+     * allocation, often a temporary, is given back at once */
+    if (a && a->active && h == a->last) {
+        a->head->used = (char *)h - BLOCK_DATA(a->head);
+        a->last = NULL;
+    }
+}
+
+void *kx_arena_realloc(void *ptr, size_t size) {
+    Karena *a = thread_arena;
+    Khdr *h;
+    void *p;
+
+    if (ptr == NULL)
+        return kx_arena_malloc(size);
+    h = (Khdr *)ptr - 1;
+    if (!h->arena) {
+        h = zrealloc(h, sizeof(Khdr) + size);
+        h->size = size;
+        return h + 1;
+    }
+    /* A string growing at the top of the block grows in place */
+    if (kx_arena_fits(size) && h == a->last) {
+        size_t start = (char *)h - BLOCK_DATA(a->head);
+        size_t need = ARENA_ALIGN(sizeof(Khdr) + size);
+
+        if (start + need <= a->head->size) {
+            a->head->used = start + need;
+            h->size = size;
+            return ptr;
+        }
+    }
+    p = kx_arena_malloc(size);
+    memcpy(p, ptr, h->size < size ? h->size : size);
+    kx_arena_free(ptr);
+    return p;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+
+/* Request scoped memory. While a request is handled, the sds strings
+ * and cJSON nodes of the worker thread are carved out of a per thread
+ * arena instead of the heap, freeing them costs nothing, and the whole
+ * arena is reset at once when the request is done. The first block of
+ * the arena is kept from one request to the next, so a steady stream
+ * of requests does no malloc/free traffic and no fragmentation.
+ *
+ * Every allocation made through these functions, in the arena or on
+ * the heap, records where it comes from, so it can be freed or resized
+ * from any thread and at any time. Memory taken from the arena must
+ * not outlive the request: what is kept longer is allocated between
+ * kx_arena_pause and kx_arena_resume. */
+
+/**
+ * @brief Install the arena allocator as the allocator of cJSON. Call
+ *        it before any cJSON object is created.
+ * 
+ * @param size Size of the arena blocks, 0 disables the arena
+ */
+void kx_arena_init(size_t size);
+
+/**
+ * @brief Serve the allocations of the calling thread from its arena
+ *        until kx_arena_end
+ */
+void kx_arena_begin(void);
+
+/**
+ * @brief Release everything allocated from the arena of the calling
+ *        thread since kx_arena_begin, and allocate from the heap again
+ */
+void kx_arena_end(void);
+
+/**
+ * @brief Allocate from the heap until kx_arena_resume, for memory that
+ *        outlives the request
+ * 
+ * @return int The state to give back to kx_arena_resume
+ */
+int kx_arena_pause(void);
+
+void kx_arena_resume(int state);
+
+void *kx_arena_malloc(size_t size);
+void *kx_arena_realloc(void *ptr, size_t size);
+void kx_arena_free(void *ptr);
+
+#endif
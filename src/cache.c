@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "kserver.h"
+#include "atomicvar.h"
+
+static Kcshard *kx_cache_shard(Kcache *c, uint32_t hash) {
+    /* The low bits pick the bucket, use the high ones for the shard. */
+    return &c->shards[(hash >> 24) & (CACHE_SHARDS - 1)];
+}
+
+static void kx_lru_unlink(Kcshard *sh, Kcentry *e) {
+    if (e->prev) e->prev->next = e->next; else sh->head = e->next;
+    if (e->next) e->next->prev = e->prev; else sh->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void kx_lru_push(Kcshard *sh, Kcentry *e) {
+    e->prev = NULL;
+    e->next = sh->head;
+    if (sh->head) sh->head->prev = e;
+    sh->head = e;
+    if (sh->tail == NULL) sh->tail = e;
+}
+
+/* Find the entry of key, with *link pointing at the bucket slot that
+ * references it so the caller can unchain it. */
+static Kcentry *kx_cache_find(Kcshard *sh, uint32_t hash, const char *key,
+                              size_t keylen, Kcentry ***link) {
+    Kcentry **l = &sh->table[hash & sh->mask];
+
+    while (*l) {
+        Kcentry *e = *l;
+        if (sdslen(e->key) == keylen && memcmp(e->key, key, keylen) == 0) {
+            if (link) *link = l;
+            return e;
+        }
+        l = &e->hnext;
+    }
+    return NULL;
+}
+
+static void kx_cache_remove(Kcshard *sh, Kcentry *e, Kcentry **link) {
+    *link = e->hnext;
+    kx_lru_unlink(sh, e);
+    sdsfree(e->key);
+    sdsfree(e->value);
+    zfree(e);
+    sh->count--;
+}
+
+Kcache *kx_cache_create(unsigned long maxentries, int ttl) {
+    Kcache *c = zcalloc(sizeof(Kcache));
+    unsigned long per = (maxentries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    unsigned long buckets = 4;
+
+    /* Keep the load factor at or below one. */
+    while (buckets < per)
+        buckets <<= 1;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        Kcshard *sh = &c->shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->table = zcalloc(sizeof(Kcentry*) * buckets);
+        sh->mask = buckets - 1;
+        sh->max = per;
+    }
+    c->ttl = (long long)ttl * 1000;
+    return c;
+}
+
+void kx_cache_free(Kcache *c) {
+    if (c == NULL)
+        return;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        Kcshard *sh = &c->shards[i];
+        Kcentry *e = sh->head;
+
+        while (e) {
+            Kcentry *next = e->next;
+            sdsfree(e->key);
+            sdsfree(e->value);
+            zfree(e);
+            e = next;
+        }
+        zfree(sh->table);
+        pthread_mutex_destroy(&sh->lock);
+    }
+    zfree(c);
+}
+
+sds kx_cache_get(Kcache *c, const char *key, size_t keylen, uint64_t *version) {
+    uint32_t hash = fnv1aHash(key, keylen);
+    Kcshard *sh = kx_cache_shard(c, hash);
+    Kcentry *e, **link;
+    sds value = NULL;
+
+    pthread_mutex_lock(&sh->lock);
+    *version = sh->version;
+    e = kx_cache_find(sh, hash, key, keylen, &link);
+    if (e) {
+        if (e->expire < ustime() / 1000) {
+            kx_cache_remove(sh, e, link);
+        } else {
+            kx_lru_unlink(sh, e);
+            kx_lru_push(sh, e);
+            value = sdsdup(e->value);
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    if (value)
+        atomicIncr(c->hits, 1);
+    else
+        atomicIncr(c->misses, 1);
+    return value;
+}
+
+void kx_cache_set(Kcache *c, const char *key, size_t keylen, const char *value,
+                  size_t valuelen, uint64_t version) {
+    uint32_t hash = fnv1aHash(key, keylen);
+    Kcshard *sh = kx_cache_shard(c, hash);
+    Kcentry *e, **link;
+    /* Entries outlive the request, they are not taken from its arena */
+    int arena = kx_arena_pause();
+    /* Allocate outside of the lock, the key is freed again if the
+     * entry already exists. */
+    sds v = sdsnewlen(value, valuelen);
+    sds k = sdsnewlen(key, keylen);
+
+    pthread_mutex_lock(&sh->lock);
+    if (sh->version != version) {
+        /* A writer deleted a key of the shard while the value was read */
+        pthread_mutex_unlock(&sh->lock);
+        sdsfree(v);
+        sdsfree(k);
+        kx_arena_resume(arena);
+        return;
+    }
+    e = kx_cache_find(sh, hash, key, keylen, &link);
+    if (e) {
+        sdsfree(e->value);
+        kx_lru_unlink(sh, e);
+        sdsfree(k);
+    } else {
+        if (sh->count >= sh->max) {
+            Kcentry *old = sh->tail;
+            uint32_t oldhash = fnv1aHash(old->key, sdslen(old->key));
+            Kcentry **oldlink;
+
+            kx_cache_find(sh, oldhash, old->key, sdslen(old->key), &oldlink);
+            kx_cache_remove(sh, old, oldlink);
+        }
+        e = zcalloc(sizeof(Kcentry));
+        e->key = k;
+        e->hnext = sh->table[hash & sh->mask];
+        sh->table[hash & sh->mask] = e;
+        sh->count++;
+    }
+    e->value = v;
+    e->expire = ustime() / 1000 + c->ttl;
+    kx_lru_push(sh, e);
+    pthread_mutex_unlock(&sh->lock);
+    kx_arena_resume(arena);
+}
+
+void kx_cache_del(Kcache *c, const char *key, size_t keylen) {
+    uint32_t hash = fnv1aHash(key, keylen);
+    Kcshard *sh = kx_cache_shard(c, hash);
+    Kcentry *e, **link;
+
+    pthread_mutex_lock(&sh->lock);
+    sh->version++;
+    e = kx_cache_find(sh, hash, key, keylen, &link);
+    if (e)
+        kx_cache_remove(sh, e, link);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void kx_cache_stats(Kcache *c, uint64_t *hits, uint64_t *misses, unsigned long *entries) {
+    unsigned long n = 0;
+
+    atomicGet(c->hits, *hits);
+    atomicGet(c->misses, *misses);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&c->shards[i].lock);
+        n += c->shards[i].count;
+        pthread_mutex_unlock(&c->shards[i].lock);
+    }
+    *entries = n;
+}
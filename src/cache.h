@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "sds.h"
+
+#define CACHE_SHARDS 16     /* Power of two */
+
+typedef struct Kcentry {
+    sds key;
+    sds value;
+    long long expire;               /* Unix time in ms after which the entry is stale */
+    struct Kcentry *hnext;          /* Next entry in the same hash bucket */
+    struct Kcentry *prev, *next;    /* LRU list, most recently used first */
+} Kcentry;
+
+/* Every shard is an independent LRU with its own lock, so threads
+ * looking up different keys rarely wait on each other. */
+typedef struct Kcshard {
+    pthread_mutex_t lock;
+    Kcentry **table;
+    unsigned long mask;             /* Number of buckets - 1 */
+    unsigned long count;            /* Entries in the shard */
+    unsigned long max;              /* Entries allowed before evicting */
+    uint64_t version;               /* Bumped by every kx_cache_del */
+    Kcentry *head, *tail;
+} Kcshard;
+
+typedef struct Kcache {
+    Kcshard shards[CACHE_SHARDS];
+    long long ttl;                  /* Entry lifetime in ms */
+    uint64_t hits;
+    uint64_t misses;
+} Kcache;
+
+/** @brief Create a bounded LRU cache of sds values
+ * 
+ * @param maxentries Maximum number of entries, spread over the shards
+ * @param ttl Seconds an entry stays valid after it was set
+ * @return The cache
+ */
+Kcache *kx_cache_create(unsigned long maxentries, int ttl);
+
+/** @brief Release the cache and all its entries */
+void kx_cache_free(Kcache *c);
+
+/** @brief Look up a key
+ * 
+ * @param version Set to the version of the shard of the key, to give
+ *                to kx_cache_set when the value is read from elsewhere
+ * @return A copy of the cached value the caller must free,
+ *         or NULL if the key is missing or expired
+ */
+sds kx_cache_get(Kcache *c, const char *key, size_t keylen, uint64_t *version);
+
+/** @brief Insert or replace a key, evicting the least recently
+ *         used entry of its shard when the shard is full. Nothing is
+ *         inserted if a key of the shard was deleted since the lookup
+ *         that returned 'version': the value may predate that write.
+ */
+void kx_cache_set(Kcache *c, const char *key, size_t keylen, const char *value,
+                  size_t valuelen, uint64_t version);
+
+/** @brief Remove a key if present */
+void kx_cache_del(Kcache *c, const char *key, size_t keylen);
+
+/** @brief Read the cache counters
+ * 
+ * @param hits Lookups answered from the cache
+ * @param misses Lookups that had to go to redis
+ * @param entries Entries currently cached
+ */
+void kx_cache_stats(Kcache *c, uint64_t *hits, uint64_t *misses, unsigned long *entries);
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "zmalloc.h"
+#include "compress.h"
+
+/* Setting up a deflate stream allocates a few hundred KB, so every
+ * thread keeps one stream per use and resets it between values, along
+ * with the output buffer, which only ever grows. They are freed when
+ * the thread exits. */
+#define ZS_GZIP     0
+#define ZS_DEFLATE  1
+#define ZS_CODEC    2
+#define ZS_NUM      3
+
+typedef struct Kzstate {
+    z_stream zs[ZS_NUM];
+    int ready[ZS_NUM];
+    z_stream inflate;       /* Stored values */
+    int inflate_ready;
+    unsigned char *out;
+    size_t cap;
+} Kzstate;
+
+/* Stored values are short JSON documents sharing the same keys, there
+ * is little to find within one of them. zlib is primed with the common
+ * parts of the file and trace schemas instead, the most frequent last.
+ * The dictionary is part of the stored format: changing it requires a
+ * new CODEC_VERSION. */
+static const char codec_dict[] =
+    "\"action\":2}\"action\":1}\"action\":0}\"time\":\"2024-\",\"filepath\":\"/home/"
+    ".txt\",\"filename\":\"\",\"username\":\"\",\"machine\":\"\",\"uuid\":\"file"
+    "{\"id\":\"\",\"ts\":17";
+
+static int compress_level = Z_DEFAULT_COMPRESSION;
+static pthread_key_t compress_key;
+static pthread_once_t compress_once = PTHREAD_ONCE_INIT;
+static __thread Kzstate *thread_zstate = NULL;
+
+static void kx_zstate_release(void *ptr) {
+    Kzstate *st = ptr;
+
+    for (int i = 0; i < ZS_NUM; i++) {
+        if (st->ready[i])
+            deflateEnd(&st->zs[i]);
+    }
+    if (st->inflate_ready)
+        inflateEnd(&st->inflate);
+    zfree(st->out);
+    zfree(st);
+}
+
+static void kx_zstate_key(void) {
+    pthread_key_create(&compress_key, kx_zstate_release);
+}
+
+static Kzstate *kx_zstate(void) {
+    if (thread_zstate == NULL) {
+        pthread_once(&compress_once, kx_zstate_key);
+        thread_zstate = zcalloc(sizeof(Kzstate));
+        pthread_setspecific(compress_key, thread_zstate);
+    }
+    return thread_zstate;
+}
+
+/* Deflate len bytes of buf into the thread buffer, after 'reserve'
+ * bytes left for the caller. Returns the end of the output, or NULL */
+static unsigned char *kx_deflate(int which, const char *buf, size_t len, size_t reserve) {
+    Kzstate *st = kx_zstate();
+    z_stream *zs = &st->zs[which];
+    size_t bound;
+    int ret;
+
+    if (!st->ready[which]) {
+        switch (which) {
+        case ZS_GZIP:
+            /* 15 bits of window, +16 for a gzip header and trailer */
+            ret = deflateInit2(zs, compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+            break;
+        case ZS_DEFLATE:
+            ret = deflateInit2(zs, compress_level, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY);
+            break;
+        default:
+            /* Raw deflate, the tag of the value replaces the header */
+            ret = deflateInit2(zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY);
+            break;
+        }
+        if (ret != Z_OK)
+            return NULL;
+        st->ready[which] = 1;
+    } else if (deflateReset(zs) != Z_OK) {
+        return NULL;
+    }
+    if (which == ZS_CODEC &&
+        deflateSetDictionary(zs, (const Bytef *)codec_dict, sizeof(codec_dict) - 1) != Z_OK)
+        return NULL;
+
+    /* Large enough for the whole output in one deflate call */
+    bound = reserve + deflateBound(zs, len);
+    if (bound > st->cap) {
+        st->out = zrealloc(st->out, bound);
+        st->cap = bound;
+    }
+
+    zs->next_in = (unsigned char *)buf;
+    zs->avail_in = len;
+    zs->next_out = st->out + reserve;
+    zs->avail_out = st->cap - reserve;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+        return NULL;
+    return zs->next_out;
+}
+
+int kx_compress_init(int level) {
+    compress_level = level;
+    kx_zstate();
+    return 0;
+}
+
+/* Parse one "coding;q=value" element of Accept-Encoding. Returns the
+ * quality, 0 if the element refuses the coding. */
+static double kx_coding_quality(const char *p, size_t len) {
+    const char *q = memchr(p, ';', len);
+
+    if (q == NULL)
+        return 1.0;
+    for (q++; q < p + len && (*q == ' ' || *q == '\t'); q++);
+    if (q + 2 > p + len || (q[0] != 'q' && q[0] != 'Q') || q[1] != '=')
+        return 1.0;
+    return strtod(q + 2, NULL);
+}
+
+int kx_compress_negotiate(const char *accept) {
+    double gzip = -1, deflate = -1, any = -1;
+    const char *p, *end;
+    size_t len, name;
+
+    for (p = accept; p && *p; p = *end ? end + 1 : end) {
+        while (*p == ' ' || *p == '\t') p++;
+        end = strchr(p, ',');
+        if (end == NULL)
+            end = p + strlen(p);
+        len = end - p;
+        name = strcspn(p, ";, \t");
+        if (name > len)
+            name = len;
+
+        if ((name == 4 && !strncasecmp(p, "gzip", 4)) ||
+            (name == 6 && !strncasecmp(p, "x-gzip", 6))) {
+            gzip = kx_coding_quality(p, len);
+        } else if (name == 7 && !strncasecmp(p, "deflate", 7)) {
+            deflate = kx_coding_quality(p, len);
+        } else if (name == 1 && *p == '*') {
+            any = kx_coding_quality(p, len);
+        }
+    }
+
+    /* A coding not listed gets the quality of "*" */
+    if (gzip < 0) gzip = any;
+    if (deflate < 0) deflate = any;
+    if (gzip > 0 && gzip >= deflate)
+        return COMPRESS_GZIP;
+    if (deflate > 0)
+        return COMPRESS_DEFLATE;
+    return COMPRESS_NONE;
+}
+
+const char *kx_compress_name(int coding) {
+    switch (coding) {
+    case COMPRESS_GZIP:     return "gzip";
+    case COMPRESS_DEFLATE:  return "deflate";
+    default:                return "identity";
+    }
+}
+
+const char *kx_compress(int coding, const char *buf, size_t len, size_t *outlen) {
+    unsigned char *end;
+
+    if (coding != COMPRESS_GZIP && coding != COMPRESS_DEFLATE)
+        return NULL;
+    end = kx_deflate(coding == COMPRESS_GZIP ? ZS_GZIP : ZS_DEFLATE, buf, len, 0);
+    if (end == NULL)
+        return NULL;
+
+    *outlen = end - thread_zstate->out;
+    return (const char *)thread_zstate->out;
+}
+
+int kx_codec_encoded(const char *buf, size_t len) {
+    return len >= CODEC_TAG_LEN && buf[0] == CODEC_TAG;
+}
+
+sds kx_codec_encode(const char *buf, size_t len) {
+    unsigned char *out, *end;
+
+    end = kx_deflate(ZS_CODEC, buf, len, CODEC_TAG_LEN);
+    if (end == NULL || (size_t)(end - thread_zstate->out) >= len)
+        return sdsnewlen(buf, len);
+
+    out = thread_zstate->out;
+    out[0] = CODEC_TAG;
+    out[1] = CODEC_VERSION;
+    return sdsnewlen(out, end - out);
+}
+
+sds kx_codec_decode(const char *buf, size_t len) {
+    Kzstate *st;
+    z_stream *zs;
+    sds s;
+    int ret;
+
+    if (!kx_codec_encoded(buf, len))
+        return sdsnewlen(buf, len);
+    if (buf[1] != CODEC_VERSION)
+        return NULL;
+
+    st = kx_zstate();
+    zs = &st->inflate;
+    if (!st->inflate_ready) {
+        if (inflateInit2(zs, -15) != Z_OK)
+            return NULL;
+        st->inflate_ready = 1;
+    } else if (inflateReset(zs) != Z_OK) {
+        return NULL;
+    }
+    if (inflateSetDictionary(zs, (const Bytef *)codec_dict, sizeof(codec_dict) - 1) != Z_OK)
+        return NULL;
+
+    /* JSON documents usually shrink 2 to 4 times */
+    s = sdsMakeRoomFor(sdsempty(), len * 4);
+    zs->next_in = (unsigned char *)buf + CODEC_TAG_LEN;
+    zs->avail_in = len - CODEC_TAG_LEN;
+    do {
+        if (sdsavail(s) == 0)
+            s = sdsMakeRoomFor(s, sdslen(s));
+        zs->next_out = (unsigned char *)s + sdslen(s);
+        zs->avail_out = sdsavail(s);
+        ret = inflate(zs, Z_FINISH);
+        sdsIncrLen(s, sdsavail(s) - zs->avail_out);
+    } while (ret == Z_BUF_ERROR && zs->avail_out == 0);
+
+    if (ret != Z_STREAM_END) {
+        sdsfree(s);
+        return NULL;
+    }
+    return s;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __COMPRESS__
+#define __COMPRESS__
+
+#include <stddef.h>
+#include "sds.h"
+
+/* HTTP content codings */
+#define COMPRESS_NONE       0
+#define COMPRESS_GZIP       1       /* RFC 1952 */
+#define COMPRESS_DEFLATE    2       /* zlib stream, RFC 1950 */
+
+/* Values stored compressed start with CODEC_TAG, which no JSON
+ * document does, and the codec version, so they can live alongside
+ * values stored as they are. The rest is a raw deflate stream. */
+#define CODEC_TAG           '\0'
+#define CODEC_VERSION       1
+#define CODEC_TAG_LEN       2
+
+/**
+ * @brief Prepare response compression
+ * 
+ * @param level zlib compression level, 1 (fastest) to 9 (smallest)
+ * @return int 0 on success, -1 otherwise
+ */
+int kx_compress_init(int level);
+
+/**
+ * @brief Choose the coding of a response from the Accept-Encoding
+ *        header of the request, gzip being preferred.
+ * 
+ * @param accept Header value, may be NULL
+ * @return int COMPRESS_GZIP, COMPRESS_DEFLATE or COMPRESS_NONE
+ */
+int kx_compress_negotiate(const char *accept);
+
+/**
+ * @brief Content-Encoding header value of a coding
+ */
+const char *kx_compress_name(int coding);
+
+/**
+ * @brief Compress a response body. The output is held in a buffer
+ *        of the calling thread, reused by its next call.
+ * 
+ * @param coding COMPRESS_GZIP or COMPRESS_DEFLATE
+ * @param buf Body
+ * @param len Body length
+ * @param outlen Set to the length of the compressed body
+ * @return const char* The compressed body, NULL on failure
+ */
+const char *kx_compress(int coding, const char *buf, size_t len, size_t *outlen);
+
+/**
+ * @brief Whether a stored value was written by kx_codec_encode
+ */
+int kx_codec_encoded(const char *buf, size_t len);
+
+/**
+ * @brief Compress a JSON document before it is stored. It is kept as
+ *        it is when compression would not make it smaller.
+ * 
+ * @return sds The value to store
+ */
+sds kx_codec_encode(const char *buf, size_t len);
+
+/**
+ * @brief Get back the JSON document of a stored value, compressed or not
+ * 
+ * @return sds The document, NULL if the value is corrupted
+ */
+sds kx_codec_decode(const char *buf, size_t len);
+
+#endif
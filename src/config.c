@@ -77,12 +77,90 @@ static void loadServerConfigFromString(char *config) {
             }
         } else if (!strcasecmp(argv[0], "redis-page") && argc == 2) {
             server.pagenum = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0], "redis-page-scans") && argc == 2) {
+            server.page_scans = atoi(argv[1]);
+            if (server.page_scans <= 0) {
+                err = "Invalid redis page scans"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-pool-size") && argc == 2) {
+            server.redis_pool_size = atoi(argv[1]);
+            if (server.redis_pool_size <= 0) {
+                err = "Invalid redis pool size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-pool-idle-timeout") && argc == 2) {
+            server.redis_pool_idle = atoi(argv[1]);
+            if (server.redis_pool_idle < 0) {
+                err = "Invalid redis pool idle timeout"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-pool-health-check") && argc == 2) {
+            server.redis_pool_check = atoi(argv[1]);
+            if (server.redis_pool_check < 0) {
+                err = "Invalid redis pool health check interval"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-pool-wait") && argc == 2) {
+            server.redis_pool_wait = atoi(argv[1]);
+            if (server.redis_pool_wait < 0) {
+                err = "Invalid redis pool wait"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-backoff-min") && argc == 2) {
+            server.redis_backoff_min = atoi(argv[1]);
+            if (server.redis_backoff_min <= 0) {
+                err = "Invalid redis backoff"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-backoff-max") && argc == 2) {
+            server.redis_backoff_max = atoi(argv[1]);
+            if (server.redis_backoff_max <= 0) {
+                err = "Invalid redis backoff"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-compression") && argc == 2) {
+            if ((server.redis_compression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-async") && argc == 2) {
+            if ((server.redis_async = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "redis-async-connections") && argc == 2) {
+            server.redis_async_conns = atoi(argv[1]);
+            if (server.redis_async_conns <= 0) {
+                err = "Invalid redis async connections"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "node_id") && argc == 2) {
+            server.node_id = atoi(argv[1]);
+            if (server.node_id < 0 || server.node_id > TRACEID_NODE_MAX) {
+                err = "Invalid node id, must be between 0 and 1023"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0], "port") && argc == 2) {
             zfree(server.httpport);
             server.httpport = argv[1][0] ? zstrdup(argv[1]) : NULL;
         } else if (!strcasecmp(argv[0], "request_timeout_ms") && argc == 2) {
             zfree(server.request_timeout);
             server.request_timeout = argv[1][0] ? zstrdup(argv[1]) : NULL;
+        } else if (!strcasecmp(argv[0], "max_request_size") && argc == 2) {
+            server.max_request_size = strtoll(argv[1], NULL, 10);
+            if (server.max_request_size <= 0) {
+                err = "Invalid max request size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "compression") && argc == 2) {
+            if ((server.compression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "compression_min_size") && argc == 2) {
+            server.compression_min_size = strtoul(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0], "compression_level") && argc == 2) {
+            server.compression_level = atoi(argv[1]);
+            if (server.compression_level < 1 || server.compression_level > 9) {
+                err = "Invalid compression level, must be between 1 and 9"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "request_arena_size") && argc == 2) {
+            server.request_arena_size = strtoul(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0], "file_cache_size") && argc == 2) {
+            server.file_cache_size = strtoul(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0], "file_cache_ttl") && argc == 2) {
+            server.file_cache_ttl = atoi(argv[1]);
+            if (server.file_cache_ttl <= 0) {
+                err = "Invalid file cache ttl"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0], "daemonize") && argc == 2) {
             if ((server.daemonize = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -106,6 +184,34 @@ static void loadServerConfigFromString(char *config) {
                 }
                 fclose(logfp);
             }
+        } else if (!strcasecmp(argv[0], "loglevel") && argc == 2) {
+            if ((server.loglevel = log_level_from_string(argv[1])) == -1) {
+                err = "Invalid log level. Must be one of trace, debug, info, warn, error, fatal";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "log_sample_rate") && argc == 2) {
+            int rate = atoi(argv[1]);
+            if (rate <= 0) {
+                err = "Invalid log sample rate"; goto loaderr;
+            }
+            server.log_sample_rate = rate;
+        } else if (!strcasecmp(argv[0], "log_async") && argc == 2) {
+            if ((server.log_async = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "log_ring_size") && argc == 2) {
+            server.log_ring_size = atoi(argv[1]);
+            if (server.log_ring_size <= 0 || server.log_ring_size > 65536) {
+                err = "Invalid log ring size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0], "log_full_policy") && argc == 2) {
+            if (!strcasecmp(argv[1], "drop")) {
+                server.log_full_policy = LOG_FULL_DROP;
+            } else if (!strcasecmp(argv[1], "block")) {
+                server.log_full_policy = LOG_FULL_BLOCK;
+            } else {
+                err = "argument must be 'drop' or 'block'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0], "auth_domain") && argc == 2) {
             zfree(server.auth_domain);
             server.auth_domain = zstrdup(argv[1]);
@@ -147,6 +253,9 @@ static void loadServerConfigFromString(char *config) {
         sdsfreesplitres(argv, argc);
     }
 
+    if (server.redis_backoff_max < server.redis_backoff_min)
+        server.redis_backoff_max = server.redis_backoff_min;
+
     sdsfreesplitres(lines, totlines);
     return;
 
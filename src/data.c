@@ -27,10 +27,10 @@
  */
 #include "kserver.h"
 
-const char *STROK = "{\"flag\":\"OK\", \"msg\":\"success\"}";
-const char *STRFAIL = "{\"flag\":\"FAIL\", \"msg\":\"failed\"}";
-const char *STRNOFOUND = "{\"flag\":\"NOFOUND\", \"msg\":\"File not found\"}";
-const char *STRERROR = "{\"flag\":\"ERROR\", \"msg\":\"Server Error\"}";
+const char *STROK = "{\"flag\":\"OK\",\"msg\":\"success\"}";
+const char *STRFAIL = "{\"flag\":\"FAIL\",\"msg\":\"failed\"}";
+const char *STRNOFOUND = "{\"flag\":\"NOFOUND\",\"msg\":\"File not found\"}";
+const char *STRERROR = "{\"flag\":\"ERROR\",\"msg\":\"Server Error\"}";
 
 sds kx_user_register(char *buf, size_t len) {
     cJSON *root = NULL;
@@ -79,34 +79,32 @@ sds kx_user_register(char *buf, size_t len) {
      * If it does not exist, insert it and send it to the client. user information*/
     if (user.flag == 1) {
         /* insert new user information directly */
-        if (redis_user_register((void*)&user, &outdata) != 0) {
+        if (redis_exec(REDIS_USER_REGISTER, (void*)&user, &outdata) != 0) {
             goto err;
         } else {
             /* User data inserted successfully */
             sdsfree(outdata);
             outdata = NULL;
             cJSON_DeleteItemFromObject(root, "flag");
-            char *jstr = cJSON_Print(root);
+            char *jstr = cJSON_PrintUnformatted(root);
             outdata = sdsnew(jstr);
-            free(jstr);
+            cJSON_free(jstr);
             log_info("(%s) User register successfully.", user.username);
         }
     } else {
-        if (redis_get_user((void*)user.machine, &outdata) != 0) {
-            /* No user data was found, insert user data */
-            if (redis_user_register((void*)&user, &outdata) != 0) {
-                log_error("(%s) User register failed.", user.username);
-                goto err;
-            } else {
-                /* User data inserted successfully */
-                sdsfree(outdata);
-                outdata = NULL;
-                cJSON_DeleteItemFromObject(root, "flag");
-                char *jstr = cJSON_Print(root);
-                outdata = sdsnew(jstr);
-                free(jstr);
-                log_info("(%s) User register successfully.", user.username);
-            }
+        /* Looked up and inserted if missing by one script call */
+        if (redis_exec(REDIS_USER_UPSERT, (void*)&user, &outdata) != 0) {
+            log_error("(%s) User register failed.", user.username);
+            goto err;
+        }
+        if (user.created) {
+            /* User data inserted successfully */
+            sdsfree(outdata);
+            cJSON_DeleteItemFromObject(root, "flag");
+            char *jstr = cJSON_PrintUnformatted(root);
+            outdata = sdsnew(jstr);
+            cJSON_free(jstr);
+            log_info("(%s) User register successfully.", user.username);
         } else {
             log_info("(%s) User already exists", user.username);
         }
@@ -122,7 +120,8 @@ err:
     if (user.username) sdsfree(user.username);
     if (root) cJSON_Delete(root);
 
-    outdata = sdsnew(STRFAIL);
+    if (outdata == NULL)
+        outdata = sdsnew(STRFAIL);
     return outdata;
 }
 
@@ -148,7 +147,7 @@ sds kx_user_get(char *buf, size_t len) {
     }
     cJSON_Delete(root);
 
-    if (redis_get_user((void*)sm, &outdata) != 0) {
+    if (redis_exec(REDIS_USER_GET_INFO, (void*)sm, &outdata) != 0) {
         goto err;
     }
 
@@ -156,7 +155,8 @@ sds kx_user_get(char *buf, size_t len) {
     return outdata;
 err:
     sdsfree(sm);
-    outdata = sdsnew(STRFAIL);
+    if (outdata == NULL)
+        outdata = sdsnew(STRFAIL);
     return outdata;
 }
 
@@ -191,22 +191,17 @@ sds kx_file_set(char *buf, size_t len) {
         goto err;
     }
     
-    char *jstr = cJSON_Print(root);
+    char *jstr = cJSON_PrintUnformatted(root);
     f.data = sdsnew(jstr);
-    free(jstr);
+    cJSON_free(jstr);
     
-    if (redis_upload_file((void*)&f, &outdata) != 0) {
-        goto err;
-    } else {
-        sdsfree(outdata);
-        outdata = NULL;
-    }
-
-    /* Save file information to the hash table belonging 
-     * to the machine for easy traversal*/
-    if (redis_upload_machine_file((void*)&f, &outdata) != 0) {
+    /* Save the file information, and in the same transaction add it to
+     * the hash table belonging to the machine for easy traversal*/
+    if (redis_exec(REDIS_SAVE_FILE, (void*)&f, &outdata) != 0) {
         goto err;
     }
+    if (server.filecache)
+        kx_cache_del(server.filecache, f.uuid, sdslen(f.uuid));
 
     if (f.data) sdsfree(f.data);
     if (f.machine) sdsfree(f.machine);
@@ -229,6 +224,7 @@ sds kx_file_get(char *buf, size_t len) {
     cJSON *jm;
     sds outdata = NULL;
     sds sm = sdsempty();
+    uint64_t version = 0;
 
     root = cJSON_ParseWithLength(buf, len);
     if (root == NULL) {
@@ -246,9 +242,22 @@ sds kx_file_get(char *buf, size_t len) {
     }
     cJSON_Delete(root);
 
-    if (redis_get_file((void*)sm, &outdata) != 0) {
+    /* Files are looked up every time a client opens one, answer hot
+     * files from memory. The entry is dropped when the file is set, and
+     * a record read from redis while that happens is not cached. */
+    if (server.filecache) {
+        outdata = kx_cache_get(server.filecache, sm, sdslen(sm), &version);
+        if (outdata) {
+            sdsfree(sm);
+            return outdata;
+        }
+    }
+
+    if (redis_exec(REDIS_GET_FILE, (void*)sm, &outdata) != 0) {
         goto err;
     }
+    if (server.filecache)
+        kx_cache_set(server.filecache, sm, sdslen(sm), outdata, sdslen(outdata), version);
 
     sdsfree(sm);
     return outdata;
@@ -259,11 +268,136 @@ err:
     return outdata;
 }
 
+sds kx_file_get_batch(char *buf, size_t len) {
+    cJSON *root = NULL, *ju, *item, *files;
+    sds outdata = NULL;
+    Kfilebatch fb;
+    char *cached = NULL;
+    uint64_t *versions = NULL;
+    int n, i;
+
+    memset(&fb, 0, sizeof(Kfilebatch));
+
+    root = cJSON_ParseWithLength(buf, len);
+    if (root == NULL) {
+        log_error("file get batch json data parse error (%s).", cJSON_GetErrorPtr());
+        goto end;
+    }
+
+    /* {"uuids":["fileuuid1","fileuuid2",...]} */
+    ju = cJSON_GetObjectItem(root, "uuids");
+    if (!cJSON_IsArray(ju) || (n = cJSON_GetArraySize(ju)) == 0 || n > FILE_BATCH_MAX) {
+        log_error("json file get batch object 'uuids' must be an array of 1 to %d uuids.", FILE_BATCH_MAX);
+        goto end;
+    }
+
+    fb.uuids = zcalloc(sizeof(sds) * n);
+    fb.values = zcalloc(sizeof(sds) * n);
+    cached = zcalloc(n);
+    versions = zcalloc(sizeof(uint64_t) * n);
+
+    /* Requested uuids, without repetitions, in request order. Those in
+     * the cache are answered from it, redis is only asked for the rest. */
+    cJSON_ArrayForEach(item, ju) {
+        if (!cJSON_IsString(item) || item->valuestring == NULL) {
+            log_error("json file get batch, uuid %d is not a string.", fb.n);
+            goto end;
+        }
+        for (i = 0; i < fb.n; i++) {
+            if (strcmp(fb.uuids[i], item->valuestring) == 0)
+                break;
+        }
+        if (i < fb.n)
+            continue;
+        fb.uuids[fb.n] = sdsnew(item->valuestring);
+        if (server.filecache) {
+            fb.values[fb.n] = kx_cache_get(server.filecache, fb.uuids[fb.n],
+                                           sdslen(fb.uuids[fb.n]), &versions[fb.n]);
+            cached[fb.n] = fb.values[fb.n] != NULL;
+        }
+        fb.n++;
+    }
+    cJSON_Delete(root);
+    root = NULL;
+
+    if (redis_get_file_batch((void*)&fb, &outdata) != 0)
+        goto end;
+
+    /* {"flag":"OK","files":{"fileuuid1":{...},"fileuuid2":"NOFOUND"}}
+     * The records are stored as JSON and inserted as they are. */
+    root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "flag", "OK");
+    files = cJSON_AddObjectToObject(root, "files");
+    for (i = 0; i < fb.n; i++) {
+        if (fb.values[i] == NULL) {
+            cJSON_AddStringToObject(files, fb.uuids[i], "NOFOUND");
+            continue;
+        }
+        cJSON_AddRawToObject(files, fb.uuids[i], fb.values[i]);
+        if (server.filecache && !cached[i])
+            kx_cache_set(server.filecache, fb.uuids[i], sdslen(fb.uuids[i]),
+                         fb.values[i], sdslen(fb.values[i]), versions[i]);
+    }
+
+    char *jstr = cJSON_PrintUnformatted(root);
+    outdata = sdsnew(jstr);
+    cJSON_free(jstr);
+
+end:
+    if (root) cJSON_Delete(root);
+    for (i = 0; i < fb.n; i++) {
+        sdsfree(fb.uuids[i]);
+        if (fb.values[i]) sdsfree(fb.values[i]);
+    }
+    zfree(fb.uuids);
+    zfree(fb.values);
+    zfree(cached);
+    zfree(versions);
+    if (outdata == NULL)
+        outdata = sdsnew(STRFAIL);
+    return outdata;
+}
+
+/* Pages can be asked for with the continuation token returned with the
+ * previous one, "" for the first page. Tokens are opaque to clients:
+ * "f<cursor>.<skip>" for files and "t<score>.<skip>" for traces.
+ * Returns 1 if the request has a valid token, 0 if it has none, and -1
+ * if the token is invalid. */
+static int kx_page_token(cJSON *root, char kind, unsigned long long *pos,
+                         unsigned long long *skip) {
+    cJSON *jt = cJSON_GetObjectItem(root, "token");
+    char *p, *end;
+
+    if (jt == NULL)
+        return 0;
+    if (!cJSON_IsString(jt) || jt->valuestring == NULL)
+        return -1;
+
+    p = jt->valuestring;
+    *pos = 0;
+    *skip = 0;
+    if (*p == '\0')
+        return 1;
+    if (*p++ != kind || *p < '0' || *p > '9')
+        return -1;
+    errno = 0;
+    *pos = strtoull(p, &end, 10);
+    if (errno != 0)
+        return -1;
+    if (*end++ != '.' || *end < '0' || *end > '9')
+        return -1;
+    *skip = strtoull(end, &end, 10);
+    if (errno != 0)
+        return -1;
+    return *end == '\0' ? 1 : -1;
+}
+
 sds kx_file_getall(char *buf, size_t len) {
     cJSON *root = NULL;
     cJSON *jm, *jp;
     sds outdata = NULL;
     Kfileall fs;
+    unsigned long long skip;
 
     memset(&fs, 0, sizeof(Kfileall));
 
@@ -282,11 +416,17 @@ sds kx_file_getall(char *buf, size_t len) {
         goto err;
     }
 
-    /* page number */
+    /* continuation token, or page number */
+    fs.token = kx_page_token(root, 'f', &fs.cursor, &skip);
+    fs.skip = skip;
+    if (fs.token < 0) {
+        log_error("json file getall object 'token' is invalid.");
+        goto err;
+    }
     jp = cJSON_GetObjectItem(root, "page");
     if (cJSON_IsNumber(jp)) {
         fs.page = jp->valueint;
-    } else {
+    } else if (!fs.token) {
         log_error("json file getall object 'page' parse error (%s).", cJSON_GetErrorPtr());
         goto err;
     }
@@ -308,9 +448,90 @@ err:
     return outdata;
 }
 
-sds kx_trace_set(char *buf, size_t len) {
+int kx_writer_write(Kwriter *w, const char *buf, size_t len) {
+    if (w->write(w->ctx, buf, len) != 0)
+        return -1;
+    w->bytes += len;
+    return 0;
+}
+
+int kx_file_getall_stream(char *buf, size_t len, Kwriter *w) {
     cJSON *root = NULL;
+    cJSON *jm;
+    Kfileall fs;
+    int ret = -1;
+
+    memset(&fs, 0, sizeof(Kfileall));
+
+    root = cJSON_ParseWithLength(buf, len);
+    if (root == NULL) {
+        log_error("file getall stream json data parse error (%s).", cJSON_GetErrorPtr());
+        goto err;
+    }
+
+    /* machine uuid */
+    jm = cJSON_GetObjectItem(root, "machine");
+    if (cJSON_IsString(jm) && (jm->valuestring != NULL)) {
+        fs.machine = sdsnew(jm->valuestring);
+    } else {
+        log_error("json file getall stream object 'machine' parse error (%s).", cJSON_GetErrorPtr());
+        goto err;
+    }
+
+    if (kx_writer_write(w, "{\"files\":[", 10) != 0)
+        goto err;
+    ret = redis_stream_fileall((void*)&fs, w);
+    if (ret == 0) {
+        ret = kx_writer_write(w, "],\"flag\":\"OK\"}", 14);
+    } else {
+        /* Tell the client the listing is incomplete, the status
+         * line is long gone. */
+        kx_writer_write(w, "],\"flag\":\"ERROR\"}", 17);
+    }
+
+err:
+    if (root) cJSON_Delete(root);
+    if (fs.machine) sdsfree(fs.machine);
+    return ret;
+}
+
+/* Fill a trace from its JSON object: the file uuid and the member
+ * stored in the sorted set.
+ *
+ * ZADD trace:fileuuid <ms> {"id":"<traceid>",...,"ts":<ms>}
+ * The time is stored in the trace as well so that it is returned to
+ * clients. The id makes every trace a distinct member of the sorted
+ * set, however many identical events arrive in the same millisecond,
+ * and comes first so that those sort by id. It is a string since
+ * 64 bit integers do not survive javascript clients.
+ * Returns 0 on success, -1 if the object is not a valid trace */
+static int kx_trace_build(cJSON *root, Ktrace *ft) {
     cJSON *ju;
+    char idstr[21];
+    char *jstr;
+
+    ju = cJSON_GetObjectItem(root, "uuid");
+    if (!cJSON_IsString(ju) || ju->valuestring == NULL)
+        return -1;
+    ft->uuid = sdsnew(ju->valuestring);
+
+    ft->id = kx_traceid_next(ustime() / 1000);
+    ft->score = kx_traceid_ms(ft->id);
+    cJSON_DeleteItemFromObject(root, "id");
+    cJSON_DeleteItemFromObject(root, "ts");
+    snprintf(idstr, sizeof(idstr), "%" PRIu64, ft->id);
+    cJSON_AddStringToObject(root, "id", idstr);
+    cJSON_InsertItemInArray(root, 0, cJSON_DetachItemFromObject(root, "id"));
+    cJSON_AddNumberToObject(root, "ts", (double)ft->score);
+
+    jstr = cJSON_PrintUnformatted(root);
+    ft->data = sdsnew(jstr);
+    cJSON_free(jstr);
+    return 0;
+}
+
+sds kx_trace_set(char *buf, size_t len) {
+    cJSON *root = NULL;
     sds outdata = NULL;
     Ktrace ft;
 
@@ -322,28 +543,15 @@ sds kx_trace_set(char *buf, size_t len) {
         goto err;
     }
 
-    /* file uuid */
-    ju = cJSON_GetObjectItem(root, "uuid");
-    if (cJSON_IsString(ju) && (ju->valuestring != NULL)) {
-        ft.uuid = sdsnew(ju->valuestring);
-    } else {
+    if (kx_trace_build(root, &ft) != 0) {
         log_error("file trace set, get object 'uuid' parse error (%s).", cJSON_GetErrorPtr());
         goto err;
     }
 
-    /* HSET filekey:fileuuid trace:1798000,*/
-    ft.tracefield = sdsnew("trace:");
-    ft.tracefield = sdscatfmt(ft.tracefield, "%U", ustime());
-
-    char *jstr = cJSON_Print(root);
-    ft.data = sdsnew(jstr);
-    free(jstr);
-
-    if (redis_set_trace((void*)&ft, &outdata) != 0)
+    if (redis_exec(REDIS_SET_TRACE, (void*)&ft, &outdata) != 0)
         goto err;
 
     if (ft.uuid) sdsfree(ft.uuid);
-    if (ft.tracefield) sdsfree(ft.tracefield);
     if (ft.data) sdsfree(ft.data);
     cJSON_Delete(root);
     return outdata;
@@ -351,12 +559,108 @@ sds kx_trace_set(char *buf, size_t len) {
 err:
     if (root) cJSON_Delete(root);
     if (ft.uuid) sdsfree(ft.uuid);
-    if (ft.tracefield) sdsfree(ft.tracefield);
+    if (ft.data) sdsfree(ft.data);
+    if (outdata == NULL)
+        outdata = sdsnew(STRFAIL);
+    return outdata;
+}
+
+sds kx_trace_set_batch(char *buf, size_t len) {
+    cJSON *root = NULL, *item, *results, *res;
+    sds outdata = NULL;
+    Ktracebatch tb;
+    char idstr[21];
+    int n, i, failed = 0;
+
+    memset(&tb, 0, sizeof(Ktracebatch));
+
+    root = cJSON_ParseWithLength(buf, len);
+    if (root == NULL) {
+        log_error("file trace batch, json data parse error (%s).", cJSON_GetErrorPtr());
+        goto end;
+    }
+
+    if (!cJSON_IsArray(root) || (n = cJSON_GetArraySize(root)) == 0) {
+        log_error("file trace batch, the request is not a non empty array.");
+        goto end;
+    }
+    if (n > TRACE_BATCH_MAX) {
+        log_error("file trace batch, %d traces exceed the limit of %d.", n, TRACE_BATCH_MAX);
+        goto end;
+    }
+
+    tb.traces = zcalloc(sizeof(Ktrace) * n);
+    tb.status = zmalloc(sizeof(int) * n);
+    tb.ntraces = n;
+
+    /* Invalid items are reported and skipped, the others are written. */
+    i = 0;
+    cJSON_ArrayForEach(item, root) {
+        if (cJSON_IsObject(item) && kx_trace_build(item, &tb.traces[i]) == 0) {
+            tb.status[i] = 0;
+        } else {
+            log_error("file trace batch, item %d has no 'uuid'.", i);
+            tb.status[i] = -1;
+        }
+        i++;
+    }
+
+    if (redis_set_trace_batch((void*)&tb, &outdata) != 0)
+        goto end;
+
+    /* {"flag":"OK","msg":"success","results":[{"id":"...","flag":"OK"},{"flag":"FAIL"}]}
+     * results are in the order of the request, flag is OK only if
+     * every trace was recorded. */
+    results = cJSON_CreateArray();
+    for (i = 0; i < n; i++) {
+        res = cJSON_CreateObject();
+        if (tb.status[i] == 0) {
+            snprintf(idstr, sizeof(idstr), "%" PRIu64, tb.traces[i].id);
+            cJSON_AddStringToObject(res, "id", idstr);
+            cJSON_AddStringToObject(res, "flag", "OK");
+        } else {
+            cJSON_AddStringToObject(res, "flag", "FAIL");
+            failed++;
+        }
+        cJSON_AddItemToArray(results, res);
+    }
+    cJSON_Delete(root);
+    root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "flag", failed ? "FAIL" : "OK");
+    cJSON_AddStringToObject(root, "msg", failed ? "failed" : "success");
+    cJSON_AddItemToObject(root, "results", results);
+
+    char *jstr = cJSON_PrintUnformatted(root);
+    if (outdata) sdsfree(outdata);
+    outdata = sdsnew(jstr);
+    cJSON_free(jstr);
+
+end:
+    if (root) cJSON_Delete(root);
+    for (i = 0; i < tb.ntraces; i++) {
+        if (tb.traces[i].uuid) sdsfree(tb.traces[i].uuid);
+        if (tb.traces[i].data) sdsfree(tb.traces[i].data);
+    }
+    zfree(tb.traces);
+    zfree(tb.status);
     if (outdata == NULL)
         outdata = sdsnew(STRFAIL);
     return outdata;
 }
 
+/* Parse an optional time bound of a trace query: a number of
+ * milliseconds, or the default ("-inf" or "+inf") if absent.
+ * Returns NULL if the value is not a number. */
+static sds kx_trace_bound(cJSON *root, const char *name, const char *dflt) {
+    cJSON *jb = cJSON_GetObjectItem(root, name);
+
+    if (jb == NULL || cJSON_IsNull(jb))
+        return sdsnew(dflt);
+    if (!cJSON_IsNumber(jb))
+        return NULL;
+    return sdsfromlonglong((long long)jb->valuedouble);
+}
+
 sds kx_trace_get(char *buf, size_t len) {
     cJSON *root = NULL;
     cJSON *jt, *jp;
@@ -380,20 +684,45 @@ sds kx_trace_get(char *buf, size_t len) {
         goto err;
     }
 
-    /* page number */
+    /* continuation token, or page number */
+    unsigned long long score, skip;
+    fg.token = kx_page_token(root, 't', &score, &skip);
+    if (fg.token < 0 || score > LLONG_MAX || skip > LLONG_MAX) {
+        log_error("json trace object 'token' is invalid.");
+        goto err;
+    }
     jp = cJSON_GetObjectItem(root, "page");
-    if (cJSON_IsNumber(jp)) {
+    if (fg.token) {
+        fg.score = (long long)score;
+        fg.offset = (long long)skip;
+    } else if (cJSON_IsNumber(jp)) {
         fg.page = jp->valueint;
+        fg.offset = (long long)fg.page * server.pagenum;
     } else {
         log_error("json trace object 'page' parse error (%s).", cJSON_GetErrorPtr());
         goto err;
     }
+
+    /* time range, in milliseconds, both ends included. A token resumes
+     * at its score, the traces of the score returned already are skipped */
+    fg.from = kx_trace_bound(root, "from", "-inf");
+    fg.to = kx_trace_bound(root, "to", "+inf");
+    if (fg.from == NULL || fg.to == NULL) {
+        log_error("json trace object 'from' or 'to' is not a number.");
+        goto err;
+    }
+    if (fg.token && (score || skip)) {
+        sdsfree(fg.from);
+        fg.from = sdsfromlonglong(fg.score);
+    }
     
-    if (redis_get_trace((void*)&fg, &outdata) != 0) {
+    if (redis_exec(REDIS_GET_TRACE, (void*)&fg, &outdata) != 0) {
         goto err;
     }
 
     if (fg.uuid) sdsfree(fg.uuid);
+    sdsfree(fg.from);
+    sdsfree(fg.to);
     cJSON_Delete(root);
 
     return outdata;
@@ -401,6 +730,8 @@ sds kx_trace_get(char *buf, size_t len) {
 err:
     if (root) cJSON_Delete(root);
     if (fg.uuid) sdsfree(fg.uuid);
+    if (fg.from) sdsfree(fg.from);
+    if (fg.to) sdsfree(fg.to);
     if (outdata == NULL) {
         outdata = sdsnew(STRFAIL);
     }
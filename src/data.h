@@ -39,6 +39,7 @@ typedef struct Kuser {
                      * otherwise return the queried data. 
                      * If the inserted data is not queried, 
                      * then return the inserted data.*/
+    int created;    /* Set by redis_upsert_user if the user was inserted */
 } Kuser;
 
 typedef struct Kfile {
@@ -47,20 +48,51 @@ typedef struct Kfile {
     sds data;     /* json data */
 } Kfile;
 
+/* Files of a /fileget/batch request */
+typedef struct Kfilebatch {
+    sds *uuids;     /* file uuids, without repetitions */
+    sds *values;    /* Record of each file, NULL if not found */
+    int n;
+} Kfilebatch;
+
+/* Destination of a streamed response. write sends len bytes and
+ * returns 0, or -1 if the client is gone. */
+typedef struct Kwriter {
+    int (*write)(void *ctx, const char *buf, size_t len);
+    void *ctx;
+    size_t bytes;       /* Bytes written so far */
+} Kwriter;
+
 typedef struct Kfileall {
     sds machine;    /* machine code (uuid)*/
     uint32_t page;  /* Page number */
+    int token;      /* Set if the request continues from a token */
+    unsigned long long cursor;  /* HSCAN cursor of the token */
+    size_t skip;    /* Elements of that cursor already returned */
 } Kfileall;
 
 typedef struct Ktrace {
     sds uuid;           /* file uuid */
-    sds tracefield;     /* trace field */
+    uint64_t id;        /* Trace identifier, see traceid.h */
+    long long score;    /* Unix time in milliseconds the trace was recorded */
     sds data;
 } Ktrace;
 
+/* Traces of a /filesettrace/batch request, of any number of files */
+typedef struct Ktracebatch {
+    Ktrace *traces;
+    int *status;    /* Per trace, 0 once recorded, -1 if invalid or failed */
+    int ntraces;
+} Ktracebatch;
+
 typedef struct Kgettrace {
     sds uuid;       /* file uuid */
     uint32_t page;  /* Page number */
+    int token;      /* Set if the request continues from a token */
+    long long offset;   /* Traces of the range already returned */
+    long long score;    /* Score of the token, all the traces skipped have it */
+    sds from;       /* Oldest trace time in ms, or "-inf" */
+    sds to;         /* Newest trace time in ms, or "+inf" */
 } Kgettrace;
 
 sds kx_user_register(char *buf, size_t len);
@@ -81,6 +113,15 @@ sds kx_file_set(char *buf, size_t len);
  */
 sds kx_file_get(char *buf, size_t len);
 
+/** @brief Get the information of several encrypted files at once
+ * 
+ * @param buf Request data (list of file uuids)
+ * @param len Request data length
+ * @return Return the record of every file, NOFOUND for the missing ones,
+ *         if failure returns failure information
+ */
+sds kx_file_get_batch(char *buf, size_t len);
+
 /** @brief Get all encrypted file information on the same machine
  * 
  * @param buf Request data (machine uudid)
@@ -90,6 +131,24 @@ sds kx_file_get(char *buf, size_t len);
  */
 sds kx_file_getall(char *buf, size_t len);
 
+/** @brief Write all encrypted file information of a machine, as
+ *         {"files":[...],"flag":"OK"}, while it is read from redis.
+ *         If the listing fails midway the document ends with
+ *         "flag":"ERROR" instead.
+ * 
+ * @param buf Request data (machine uudid)
+ * @param len Request data length
+ * @param w Destination of the listing
+ * @return Returns 0 on success, -1 otherwise
+ */
+int kx_file_getall_stream(char *buf, size_t len, Kwriter *w);
+
+/** @brief Send data to a streamed response
+ * 
+ * @return Returns 0 on success, -1 if the client is gone
+ */
+int kx_writer_write(Kwriter *w, const char *buf, size_t len);
+
 /** @brief Upload traceability information
  * 
  * @param buf Request data (machine uudid)
@@ -98,6 +157,15 @@ sds kx_file_getall(char *buf, size_t len);
  */
 sds kx_trace_set(char *buf, size_t len);
 
+/** @brief Upload a batch of traceability information
+ * 
+ * @param buf Request data, an array of traces of any files
+ * @param len Request data length
+ * @return Return the status of every trace, in request order,
+ *         if failure returns failure information
+ */
+sds kx_trace_set_batch(char *buf, size_t len);
+
 /** @brief Get file traceability information
  * 
  * @param buf Request data
@@ -29,77 +29,456 @@
 
 /* The number of data items obtained per page in paging */
 #define PAGENUM 20
-#define REDIS_CLI_KEEPALIVE_INTERVAL 15 /* seconds */
 
-static redisContext *create_redis_ctx();
-static int kx_post_reply(redisReply *reply, sds *out);
-static int kx_hgetall_userinfo(redisReply *reply, sds *out);
-static int kx_hget_file(redisReply *reply, sds *out);
-static int kx_hscan_files(redisReply *reply, sds *out);
-static int kx_hscan_traces(redisReply *reply, sds *out);
+static int kx_post_reply(redisReply *reply, void *data, sds *out);
+static int kx_hgetall_userinfo(redisReply *reply, void *data, sds *out);
+static int kx_hget_file(redisReply *reply, void *data, sds *out);
+static int kx_hscan_files(redisReply *reply, void *data, sds *out);
+static int kx_zadd_reply(redisReply *reply, void *data, sds *out);
+static int kx_zrange_traces(redisReply *reply, void *data, sds *out);
+static int kx_upsert_user(redisReply *reply, void *data, sds *out);
+static sds kx_encode_value(sds json);
+static void kx_free_value(sds value, sds json);
+
+/* Command template arguments, see Kargtpl */
+#define LIT(s)          {s, sizeof(s) - 1, ARG_NONE}
+#define KEY(prefix, n)  {prefix, sizeof(prefix) - 1, n}
+#define ARG(n)          {"", 0, n}
+#define SHA             {"", 0, ARG_SHA}
+
+/* Request data members the arguments are read from, see Kfield */
+#define SELF            {KARG_DATA, 0}
+#define MEMBER(t, m)    {KARG_SDS, offsetof(t, m)}
+#define STORED(t, m)    {KARG_VALUE, offsetof(t, m)}
+#define LLONG(t, m)     {KARG_LLONG, offsetof(t, m)}
+#define UINT32(t, m)    {KARG_UINT32, offsetof(t, m)}
+#define PAGESIZE(more)  {KARG_PAGENUM, more}
+
+#define SDSARG(s)       ((Karg){(s), sdslen(s)})
+#define NUMARG_SIZE     24
 
 struct action acs[] = {
     /* redis HMSET key field value [field value ...]
      * Sets the specified fields to their respective values in the hash stored at key. 
      * This command overwrites any specified fields already existing in the hash.
      * If key does not exist, a new key holding a hash is created. */
-    {.type = REDIS_USER_REGISTER, .cmdline = "HMSET userkey:%s uuid %s username %s", .syncexec = kx_post_reply},
+    [REDIS_USER_REGISTER] = {.type = REDIS_USER_REGISTER,
+     .argv = {LIT("HMSET"), KEY("userkey:", 0), LIT("uuid"), ARG(0), LIT("username"), ARG(1)},
+     .args = {MEMBER(Kuser, machine), MEMBER(Kuser, username)}, .syncexec = kx_post_reply},
     /* Returns all fields and values of the hash stored at key. In the returned value, 
      * every field name is followed by its value, so the length of the reply is twice
      * the size of the hash.*/
-    {.type = REDIS_USER_GET_INFO, .cmdline = "HGETALL userkey:%s", .syncexec = kx_hgetall_userinfo},
+    [REDIS_USER_GET_INFO] = {.type = REDIS_USER_GET_INFO, .argv = {LIT("HGETALL"), KEY("userkey:", 0)},
+     .args = {SELF}, .syncexec = kx_hgetall_userinfo},
     /* SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]
      * SCAN is a cursor based iterator. This means that at every call of the command, 
      * the server returns an updated cursor that the user needs to use as the cursor 
      * argument in the next call.*/
-    {.type = REDIS_USER_GET_ALL_INFO, .cmdline = "SCAN %d MATCH userkey:* COUNT %d", .syncexec = kx_post_reply},
+    [REDIS_USER_GET_ALL_INFO] = {.type = REDIS_USER_GET_ALL_INFO, .argv = {LIT("SCAN"), ARG(0), LIT("MATCH"), LIT("userkey:*"), LIT("COUNT"), ARG(1)}, .syncexec = kx_post_reply},
     /* HSET key field value [field value ...]
      * Sets the specified fields to their respective values in the hash stored at key.
      * This command overwrites the values of specified fields that exist in the hash. 
      * If key doesn't exist, a new key holding a hash is created.
      * example:
      * HSET filekey:file1uuid file1uuid '{"uuid":"file1","filename":"file1.txt","filepath":"/path/to/file1.txt"}' */
-    {.type = REDIS_SET_FILE, .cmdline = "HSET filekey:%s %s %s", .syncexec = kx_post_reply},
+    [REDIS_SET_FILE] = {.type = REDIS_SET_FILE, .argv = {LIT("HSET"), KEY("filekey:", 0), ARG(0), ARG(2)},
+     .args = {MEMBER(Kfile, uuid), MEMBER(Kfile, machine), STORED(Kfile, data)}, .syncexec = kx_post_reply},
     /* HSET machine:machineuuid file1uuid '{"uuid":"file1","filename":"file1.txt","filepath":"/path/to/file1.txt"}' */
-    {.type = REDIS_SET_MACHINE_FILE, .cmdline = "HSET machine:%s %s %s", .syncexec = kx_post_reply},
+    [REDIS_SET_MACHINE_FILE] = {.type = REDIS_SET_MACHINE_FILE, .argv = {LIT("HSET"), KEY("machine:", 1), ARG(0), ARG(2)},
+     .args = {MEMBER(Kfile, uuid), MEMBER(Kfile, machine), STORED(Kfile, data)}, .syncexec = kx_post_reply},
     /* HGET key field
      * Returns the value associated with field in the hash stored at key. 
      * example:
      * HGET filekey:machine file1uuid */
-    {.type = REDIS_GET_FILE, .cmdline = "HGET filekey:%s %s", .syncexec = kx_hget_file},
+    [REDIS_GET_FILE] = {.type = REDIS_GET_FILE, .argv = {LIT("HGET"), KEY("filekey:", 0), ARG(0)},
+     .args = {SELF}, .syncexec = kx_hget_file},
     /* HSCAN key cursor [MATCH pattern] [COUNT count] [NOVALUES]
      * O(1) for every call. O(N) for a complete iteration, including enough 
      * command calls for the cursor to return back to 0. N is the number of 
      * elements inside the collection.
      * example:
      * HSCAN machine:machineuuid 0 count 10 */
-    {.type = REDIS_GET_ALL_FILES, .cmdline = "HSCAN machine:%s %d COUNT %d", .syncexec = kx_hscan_files},
-    /* HSET key field value [field value ...]
-     * Sets the specified fields to their respective values in the hash stored at key.
-     * This command overwrites the values of specified fields that exist in the hash. 
-     * If key doesn't exist, a new key holding a hash is created.
+    [REDIS_GET_ALL_FILES] = {.type = REDIS_GET_ALL_FILES,
+     .argv = {LIT("HSCAN"), KEY("machine:", 0), ARG(1), LIT("COUNT"), ARG(2)},
+     .args = {MEMBER(Kfileall, machine), UINT32(Kfileall, page), PAGESIZE(0)}, .syncexec = kx_hscan_files},
+    /* ZADD key score member
+     * Traces of a file live in their own sorted set, scored by the time
+     * they were recorded in milliseconds, so they come back in time order
+     * and a time range is a direct lookup. Members are never compressed:
+     * traces of the same millisecond are ordered by the member bytes,
+     * which must start with the trace id.
+     * example:
+     * ZADD trace:fileuuid 1715000000000 '{"uuid":"file1","username":"username","time":"2024-05-06","action":1,"ts":1715000000000}' */
+    [REDIS_SET_TRACE] = {.type = REDIS_SET_TRACE, .argv = {LIT("ZADD"), KEY("trace:", 0), ARG(1), ARG(2)},
+     .args = {MEMBER(Ktrace, uuid), LLONG(Ktrace, score), MEMBER(Ktrace, data)}, .syncexec = kx_zadd_reply},
+    /* ZRANGEBYSCORE key min max WITHSCORES LIMIT offset count
+     * O(log(N)+M) with N the number of traces of the file and M the
+     * offset plus the count. A token starts at the score of the last trace
+     * returned, past the traces of that score already returned.
      * example:
-     * HSET filekey:fileuuid trace:1798000 '{"uuid":"file1","username":"username","time":"2024-05-06", "action":1}' */
-    {.type = REDIS_SET_TRACE, .cmdline = "HSET filekey:%s %s %s", .syncexec = kx_post_reply},
-    /* HSCAN filekey:fileuuis 0 match trace:* count 10 */
-    {.type = REDIS_GET_TRACE, .cmdline = "HSCAN filekey:%s %d MATCH trace:* COUNT %d", .syncexec = kx_hscan_traces},
+     * ZRANGEBYSCORE trace:fileuuid -inf +inf WITHSCORES LIMIT 0 21 */
+    [REDIS_GET_TRACE] = {.type = REDIS_GET_TRACE,
+     .argv = {LIT("ZRANGEBYSCORE"), KEY("trace:", 0), ARG(1), ARG(2), LIT("WITHSCORES"),
+              LIT("LIMIT"), ARG(3), ARG(4)},
+     /* One trace more than a page holds tells whether there is a next page */
+     .args = {MEMBER(Kgettrace, uuid), MEMBER(Kgettrace, from), MEMBER(Kgettrace, to),
+              LLONG(Kgettrace, offset), PAGESIZE(1)},
+     .syncexec = kx_zrange_traces},
+    /* MULTI
+     * HSET filekey:file1uuid file1uuid '{...}'
+     * HSET machine:machineuuid file1uuid '{...}'
+     * EXEC
+     * All four commands are written at once and the replies read back
+     * together, the file is visible in both hashes or in neither. */
+    [REDIS_SAVE_FILE] = {.type = REDIS_SAVE_FILE, .multi = 1, .npipeline = 2, .pipeline = {REDIS_SET_FILE, REDIS_SET_MACHINE_FILE}},
+    /* EVALSHA sha1 1 userkey:machine machine username
+     * Returns the user hash if it exists, otherwise registers the user
+     * and returns 0. Scripts run atomically, no other client can insert
+     * the user between the check and the HMSET. */
+    [REDIS_USER_UPSERT] = {.type = REDIS_USER_UPSERT,
+     .argv = {LIT("EVALSHA"), SHA, LIT("1"), KEY("userkey:", 0), ARG(0), ARG(1)},
+     .args = {MEMBER(Kuser, machine), MEMBER(Kuser, username)}, .syncexec = kx_upsert_user,
+     .script = "local h = redis.call('HGETALL', KEYS[1]) "
+               "if #h > 0 then return h end "
+               "redis.call('HMSET', KEYS[1], 'uuid', ARGV[1], 'username', ARGV[2]) "
+               "return 0"},
 };
 
 #define ACSIZE sizeof(acs)/sizeof(acs[0])
 
-static struct action *kx_search_action(Kdbtype type) {
-    struct action *ac = NULL;
-    for (int i = 0; i < ACSIZE; i++) {
-        if (acs[i].type == type)
-            ac = &(acs[i]);
+/* A Kdbtype added without its action fails to compile here. An entry
+ * left out in the middle is caught by redis_load_scripts at startup. */
+typedef char kx_acs_complete[ACSIZE == REDIS_ACTION_MAX ? 1 : -1];
+
+static inline struct action *kx_action(Kdbtype type) {
+    return &acs[type];
+}
+
+/* Argument values of the commands of an action, with the storage of
+ * the numbers and of the values encoded for redis */
+typedef struct Kbind {
+    Karg args[ACTION_MAX_ARGV];
+    char nums[ACTION_MAX_ARGV][NUMARG_SIZE];
+    int nvalues;
+    sds plain[ACTION_MAX_ARGV];
+    sds encoded[ACTION_MAX_ARGV];
+} Kbind;
+
+static Karg kx_numarg(char *buf, long long value) {
+    return (Karg){buf, (size_t)snprintf(buf, NUMARG_SIZE, "%lld", value)};
+}
+
+/* A value bound by several commands of a pipeline is encoded once */
+static sds kx_bind_value(Kbind *b, sds plain) {
+    for (int i = 0; i < b->nvalues; i++) {
+        if (b->plain[i] == plain)
+            return b->encoded[i];
+    }
+    b->plain[b->nvalues] = plain;
+    b->encoded[b->nvalues] = kx_encode_value(plain);
+    return b->encoded[b->nvalues++];
+}
+
+/* Read the arguments of the command of an action from the request data */
+static void kx_bind(const struct action *ac, void *data, Kbind *b) {
+    for (int i = 0; i < ACTION_MAX_ARGV && ac->args[i].type != KARG_NONE; i++) {
+        const Kfield *f = &ac->args[i];
+        char *member = (char*)data + f->offset;
+
+        switch (f->type) {
+        case KARG_DATA:
+            b->args[i] = SDSARG((sds)data);
+            break;
+        case KARG_SDS:
+            b->args[i] = SDSARG(*(sds*)member);
+            break;
+        case KARG_VALUE:
+            b->args[i] = SDSARG(kx_bind_value(b, *(sds*)member));
+            break;
+        case KARG_LLONG:
+            b->args[i] = kx_numarg(b->nums[i], *(long long*)member);
+            break;
+        case KARG_UINT32:
+            b->args[i] = kx_numarg(b->nums[i], *(uint32_t*)member);
+            break;
+        case KARG_PAGENUM:
+            b->args[i] = kx_numarg(b->nums[i], (long long)server.pagenum + f->offset);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void kx_bind_free(Kbind *b) {
+    for (int i = 0; i < b->nvalues; i++)
+        kx_free_value(b->encoded[i], b->plain[i]);
+    b->nvalues = 0;
+}
+
+/* Encode the command of an action for the given argument values. The
+ * arguments made of a prefix and a value, like the keys, are put
+ * together in a single scratch buffer, on the stack unless they are
+ * large. Returns the length of *cmd, -1 on error. */
+static long long kx_format_action(struct action *ac, const Karg *args, char **cmd) {
+    const char      *argv[ACTION_MAX_ARGV];
+    size_t          argvlen[ACTION_MAX_ARGV] = {0};
+    char            stack[256], *scratch = stack, *p;
+    const Kargtpl   *t;
+    size_t          need = 0;
+    long long       len;
+    int             argc;
+
+    for (argc = 0; argc < ACTION_MAX_ARGV && ac->argv[argc].prefix; argc++) {
+        t = &ac->argv[argc];
+        if (t->arg >= 0 && t->prefixlen)
+            need += t->prefixlen + args[t->arg].len;
+    }
+    if (need > sizeof(stack))
+        scratch = zmalloc(need);
+
+    p = scratch;
+    for (int i = 0; i < argc; i++) {
+        t = &ac->argv[i];
+        if (t->arg == ARG_NONE) {
+            argv[i] = t->prefix;
+            argvlen[i] = t->prefixlen;
+        } else if (t->arg == ARG_SHA) {
+            argv[i] = ac->sha;
+            argvlen[i] = sdslen(ac->sha);
+        } else if (t->prefixlen == 0) {
+            argv[i] = args[t->arg].ptr;
+            argvlen[i] = args[t->arg].len;
+        } else {
+            memcpy(p, t->prefix, t->prefixlen);
+            memcpy(p + t->prefixlen, args[t->arg].ptr, args[t->arg].len);
+            argv[i] = p;
+            argvlen[i] = t->prefixlen + args[t->arg].len;
+            p += argvlen[i];
+        }
+    }
+
+    len = redisFormatCommandArgv(cmd, argc, argv, argvlen);
+    if (scratch != stack)
+        zfree(scratch);
+    return len;
+}
+
+/* Send commands encoded by redisFormatCommand and collect one reply
+ * per command. With redis-async the commands go through the I/O thread,
+ * otherwise they are written at once on a pooled connection. On failure
+ * no reply is returned and outdata is set to an error.
+ * Returns 0 on success, -1 otherwise */
+static int kx_execute(char **cmds, size_t *lens, int ncmds, redisReply **replies, sds *outdata) {
+    Kconn       *conn;
+    int         i, ret = -1, busy = 0;
+    long long   start = kx_metrics_now();
+
+    if (server.redis_async) {
+        ret = kx_aio_execute(cmds, lens, ncmds, replies);
+    } else if ((conn = kx_pool_checkout()) == NULL) {
+        busy = errno == EBUSY;
+    } else {
+        for (i = 0; i < ncmds; i++)
+            redisAppendFormattedCommand(conn->ctx, cmds[i], lens[i]);
+        /* The first redisGetReply writes out everything queued above. */
+        for (i = 0; i < ncmds; i++) {
+            if (redisGetReply(conn->ctx, (void **)&replies[i]) != REDIS_OK) {
+                log_error("redis error: %s", conn->ctx->errstr);
+                break;
+            }
+        }
+        if (i == ncmds) {
+            ret = 0;
+        } else {
+            while (i--) {
+                freeReplyObject(replies[i]);
+                replies[i] = NULL;
+            }
+        }
+        kx_pool_checkin(conn);
+    }
+    kx_metrics_redis_add(kx_metrics_now() - start);
+
+    if (busy) {
+        /* every pooled connection stayed busy, the request failed */
+        *outdata = sdsnew(STRFAIL);
+    } else if (ret != 0) {
+        /* redis is unreachable, fail fast with a server error */
+        *outdata = sdsnew(STRERROR);
+    }
+    return ret;
+}
+
+/* Load the script of a scripted action into redis. The first load
+ * publishes the sha1 of the script, it never changes so later loads,
+ * after a NOSCRIPT, keep it.
+ * Returns 0 on success, -1 otherwise */
+static int kx_script_load(struct action *ac, sds *outdata) {
+    redisReply  *reply = NULL;
+    char        *cmd;
+    size_t      len;
+    sds         sha, expected = NULL;
+    int         ret;
+
+    if ((ret = redisFormatCommand(&cmd, "SCRIPT LOAD %s", ac->script)) < 0)
+        return -1;
+    len = ret;
+    ret = kx_execute(&cmd, &len, 1, &reply, outdata);
+    redisFreeCommand(cmd);
+    if (ret != 0)
+        return -1;
+
+    if (reply->type != REDIS_REPLY_STRING) {
+        log_error("redis SCRIPT LOAD error (%s)", reply->type == REDIS_REPLY_ERROR ? reply->str : "");
+        freeReplyObject(reply);
+        return -1;
+    }
+    /* The sha1 is kept for the life of the server, out of the arena
+     * of the request that loaded the script */
+    int arena = kx_arena_pause();
+    sha = sdsnewlen(reply->str, reply->len);
+    kx_arena_resume(arena);
+    freeReplyObject(reply);
+    if (!__atomic_compare_exchange_n(&ac->sha, &expected, sha, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        sdsfree(sha);
+    return 0;
+}
+
+static int kx_is_noscript(redisReply *reply) {
+    return reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "NOSCRIPT", 8) == 0;
+}
+
+/* Run the command of an action on the request data and hand the
+ * reply and the request data to its syncexec. A scripted action whose
+ * script redis forgot, after a restart or a SCRIPT FLUSH, loads it
+ * again and retries once.
+ * Returns 0 on success, -1 otherwise */
+static int kx_action_exec(struct action *ac, void *data, sds *outdata) {
+    redisReply      *reply = NULL;
+    Kbind           b;
+    char            *cmd;
+    size_t          len;
+    long long       ret;
+    int             retry = 1;
+
+    b.nvalues = 0;
+    kx_bind(ac, data, &b);
+again:
+    if (ac->script && __atomic_load_n(&ac->sha, __ATOMIC_ACQUIRE) == NULL &&
+        kx_script_load(ac, outdata) != 0) {
+        ret = -1;
+        goto end;
+    }
+
+    if ((ret = kx_format_action(ac, b.args, &cmd)) < 0)
+        goto end;
+    len = ret;
+
+    ret = kx_execute(&cmd, &len, 1, &reply, outdata);
+    redisFreeCommand(cmd);
+    if (ret == 0 && ac->script && retry && kx_is_noscript(reply)) {
+        freeReplyObject(reply);
+        reply = NULL;
+        retry = 0;
+        if (kx_script_load(ac, outdata) != 0) {
+            ret = -1;
+            goto end;
+        }
+        goto again;
+    }
+    if (ret == 0) {
+        ret = ac->syncexec(reply, data, outdata);
+        freeReplyObject(reply);
     }
-    return ac;
+end:
+    kx_bind_free(&b);
+    return ret;
+}
+
+/* Run a pipeline action: encode every command of the pipeline (inside
+ * MULTI/EXEC if requested), send them in a single write and collect
+ * all replies. Each reply is handed to the syncexec of its action, the
+ * output of the last one is returned.
+ * Returns 0 if every command succeeded, -1 otherwise */
+static int kx_pipeline_exec(struct action *ac, void *data, sds *outdata) {
+    struct action   *sub;
+    char            *cmds[ACTION_MAX_PIPELINE + 2] = {NULL};
+    size_t          lens[ACTION_MAX_PIPELINE + 2];
+    redisReply      *replies[ACTION_MAX_PIPELINE + 2] = {NULL};
+    redisReply      **results;
+    Kbind           b;
+    long long       len;
+    int             ncmds = 0, ret = -1;
+
+    b.nvalues = 0;
+    if (ac->multi) {
+        if ((len = redisFormatCommand(&cmds[ncmds], "MULTI")) < 0)
+            goto end;
+        lens[ncmds++] = len;
+    }
+    for (int i = 0; i < ac->npipeline; i++) {
+        sub = kx_action(ac->pipeline[i]);
+        kx_bind(sub, data, &b);
+        if ((len = kx_format_action(sub, b.args, &cmds[ncmds])) < 0)
+            goto end;
+        lens[ncmds++] = len;
+    }
+    if (ac->multi) {
+        if ((len = redisFormatCommand(&cmds[ncmds], "EXEC")) < 0)
+            goto end;
+        lens[ncmds++] = len;
+    }
+
+    if (kx_execute(cmds, lens, ncmds, replies, outdata) != 0)
+        goto end;
+
+    if (ac->multi) {
+        /* MULTI -> OK, every command -> QUEUED, EXEC -> array of replies,
+         * or an error if a command was rejected while queuing. */
+        redisReply *exec = replies[ncmds - 1];
+        if (exec->type != REDIS_REPLY_ARRAY || exec->elements != (size_t)ac->npipeline) {
+            log_error("redis transaction aborted (%s)", exec->type == REDIS_REPLY_ERROR ? exec->str : "");
+            goto end;
+        }
+        results = exec->element;
+    } else {
+        results = replies;
+    }
+
+    ret = 0;
+    for (int i = 0; i < ac->npipeline; i++) {
+        sds out = NULL;
+
+        sub = kx_action(ac->pipeline[i]);
+        if (sub->syncexec(results[i], data, &out) != 0)
+            ret = -1;
+        if (ret == 0 && out) {
+            if (*outdata) sdsfree(*outdata);
+            *outdata = out;
+        } else if (out) {
+            sdsfree(out);
+        }
+    }
+    if (ret != 0 && *outdata) {
+        sdsfree(*outdata);
+        *outdata = NULL;
+    }
+
+end:
+    for (int i = 0; i < ncmds; i++) {
+        if (replies[i]) freeReplyObject(replies[i]);
+        redisFreeCommand(cmds[i]);
+    }
+    kx_bind_free(&b);
+    return ret;
 }
 
 /* When inserting data using the post method, redis returns ‘OK’. 
  * This method is generally used to process redis replies.
  * Returns 0 on success, -1 otherwise */
-static int kx_post_reply(redisReply *reply, sds *out) {
+static int kx_post_reply(redisReply *reply, void *data, sds *out) {
     int ret = -1;
 
     if (reply) {
@@ -122,14 +501,13 @@ static int kx_post_reply(redisReply *reply, sds *out) {
         }
     }
 
-    freeReplyObject(reply);
     return ret;
 }
 
 /* Query single user information through uuid 
  * and obtain returned user data ,
  * Returns 0 on success, -1 otherwise*/
-static int kx_hgetall_userinfo(redisReply *reply, sds *out) {
+static int kx_hgetall_userinfo(redisReply *reply, void *data, sds *out) {
     int ret = -1;
     cJSON *json = NULL;
     /* It is just to determine whether the data is queried. 
@@ -155,138 +533,220 @@ static int kx_hgetall_userinfo(redisReply *reply, sds *out) {
          * If there is data, data is returned. If there is no data, NULL 
          * is returned.*/
         if (flag) {
-            char *jstr = cJSON_Print(json);
+            char *jstr = cJSON_PrintUnformatted(json);
             *out = sdsnew(jstr);
-            free(jstr);
+            cJSON_free(jstr);
             ret = 0;
         }   
     }
 end:
     if (json) cJSON_Delete(json);
-    freeReplyObject(reply);
     return ret;
 }
 
-/* Query single file information through file uuid 
- * and obtain returned file data ,
- * Returns 0 on success, -1 otherwise*/
-static int kx_hget_file(redisReply *reply, sds *out) {
-    int ret = -1;
+/* The upsert script returns the user hash if the user existed, in the
+ * HGETALL format, and 0 once it registered it.
+ * Returns 0 on success, -1 otherwise */
+static int kx_upsert_user(redisReply *reply, void *data, sds *out) {
+    Kuser *u = (Kuser*)data;
 
-    if (reply && reply->type == REDIS_REPLY_STRING) {
-        *out = sdsnew(reply->str);
-        ret = 0;
-    } else if (reply->type == REDIS_REPLY_NIL) {
-        *out = sdsnew(STRNOFOUND);
+    u->created = reply->type == REDIS_REPLY_INTEGER;
+    if (u->created) {
+        *out = sdsnew(STROK);
+        return 0;
     }
-    freeReplyObject(reply);
-    return ret;
+    if (reply->type == REDIS_REPLY_ERROR)
+        log_error("redis user upsert error (%s)", reply->str);
+    return kx_hgetall_userinfo(reply, data, out);
 }
 
-/* Parse HSCAN query file list
- * Returns 0 on success, -1 otherwise */
-static int kx_hscan_files(redisReply *reply, sds *out) {
-    int ret = -1;
-    unsigned long long cursor = 0;
-    redisReply *keys;
-    cJSON *root = NULL;
-    cJSON *files = NULL;
+/* Values are JSON documents, compressed with redis-compression. Both
+ * kinds can be found whatever the setting, they are told apart by the
+ * codec tag. */
 
-    cursor = strtoull(reply->element[0]->str, NULL, 10);
-    keys = reply->element[1];
-    if (keys->type != REDIS_REPLY_ARRAY) {
-        log_error("Invalid keys array in HSCAN reply");
-        goto end;
-    }
+/* Returns the value to store for a JSON document, to be freed
+ * with kx_free_value */
+static sds kx_encode_value(sds json) {
+    return server.redis_compression ? kx_codec_encode(json, sdslen(json)) : json;
+}
 
-    root = cJSON_CreateObject();
-    if (root == NULL) {
-        log_error("HSCAN reply Failed to create cJSON object");
-        goto end;
-    }
+static void kx_free_value(sds value, sds json) {
+    if (value != json)
+        sdsfree(value);
+}
 
-    cJSON_AddNumberToObject(root, "page", cursor);
+/* Returns the JSON document of a stored value, NULL if corrupted */
+static sds kx_decode_value(const char *buf, size_t len) {
+    sds json = kx_codec_decode(buf, len);
 
-    files = cJSON_CreateArray();
-    if (files == NULL) {
-        log_error("Failed to create files array");
-        goto end;
+    if (json == NULL)
+        log_error("corrupted compressed value of %zu bytes", len);
+    return json;
+}
+
+/* Append the JSON document of a stored value to a list, comma
+ * separated. Plain documents are copied byte for byte, corrupted
+ * ones are left out. */
+static sds kx_cat_value(sds s, redisReply *value, size_t *count) {
+    sds json = NULL;
+    const char *buf = value->str;
+    size_t len = value->len;
+
+    if (kx_codec_encoded(buf, len)) {
+        if ((json = kx_decode_value(buf, len)) == NULL)
+            return s;
+        buf = json;
+        len = sdslen(json);
     }
-    cJSON_AddItemToObject(root, "files", files);
+    if ((*count)++) s = sdscatlen(s, ",", 1);
+    s = sdscatlen(s, buf, len);
+    if (json) sdsfree(json);
+    return s;
+}
 
-    if (reply->type == REDIS_REPLY_ARRAY) {
-        for (size_t i = 0; i < keys->elements; i += 2) {
-            redisReply *key = keys->element[i];
-            redisReply *value = keys->element[i + 1];
-            if (key->type == REDIS_REPLY_STRING && value->type == REDIS_REPLY_STRING) {
-                cJSON_AddItemToArray(files, cJSON_Parse(value->str));
-                ret = 0;
-            }
-        }
-        char *jstr = cJSON_Print(root);
-        *out = sdsnew(jstr);
-        free(jstr);
+/* Query single file information through file uuid 
+ * and obtain returned file data ,
+ * Returns 0 on success, -1 otherwise*/
+static int kx_hget_file(redisReply *reply, void *data, sds *out) {
+    int ret = -1;
+
+    if (reply && reply->type == REDIS_REPLY_STRING) {
+        *out = kx_decode_value(reply->str, reply->len);
+        if (*out)
+            ret = 0;
     } else if (reply->type == REDIS_REPLY_NIL) {
         *out = sdsnew(STRNOFOUND);
     }
-    
-end:
-    if (root) cJSON_Delete(root);
-    freeReplyObject(reply);
     return ret;
 }
 
-/* Parse HSCAN query file trace list
+/* Build a paging response
+ *
+ *   {<head>,"<name>":[<value>,<value>,...]}
+ *
+ * from every 'stride'th of the n reply elements starting at values,
+ * head being the JSON members describing the page, like "page":3.
+ * The stored values are already JSON documents, so instead of parsing
+ * and re-printing them they are copied byte for byte. The output buffer
+ * is sized once from the element lengths. */
+static sds kx_page_splice(const char *head, size_t headlen, const char *name,
+                          redisReply **values, size_t n, size_t stride) {
+    size_t total, count = 0;
+    sds s;
+
+    /* {head, "name": [ , ]} */
+    total = 8 + headlen + strlen(name);
+    for (size_t i = 0; i < n; i += stride)
+        total += values[i]->len + 1;
+
+    s = sdsMakeRoomFor(sdsempty(), total);
+    s = sdscatlen(s, "{", 1);
+    s = sdscatlen(s, head, headlen);
+    s = sdscatlen(s, ",\"", 2);
+    s = sdscat(s, name);
+    s = sdscatlen(s, "\":[", 3);
+    for (size_t i = 0; i < n; i += stride) {
+        if (values[i]->type == REDIS_REPLY_STRING)
+            s = kx_cat_value(s, values[i], &count);
+    }
+    s = sdscatlen(s, "]}", 2);
+    return s;
+}
+
+/* Build a paging response from an HSCAN reply, the page being the
+ * cursor to continue from. An empty page is a valid answer: HSCAN may
+ * return no element for a cursor that is not finished yet.
  * Returns 0 on success, -1 otherwise */
-static int kx_hscan_traces(redisReply *reply, sds *out) {
-    int ret = -1;
-    unsigned long long cursor = 0;
-    redisReply *keys;
-    cJSON *root = NULL;
-    cJSON *traces = NULL;
+static int kx_hscan_splice(redisReply *reply, const char *name, sds *out) {
+    redisReply *cursor, *keys;
 
-    cursor = strtoull(reply->element[0]->str, NULL, 10);
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+        log_error("Invalid HSCAN reply");
+        return -1;
+    }
+    cursor = reply->element[0];
     keys = reply->element[1];
-    if (keys->type != REDIS_REPLY_ARRAY) {
+    if (cursor->type != REDIS_REPLY_STRING || keys->type != REDIS_REPLY_ARRAY) {
         log_error("Invalid keys array in HSCAN reply");
-        goto end;
+        return -1;
     }
 
-    root = cJSON_CreateObject();
-    if (root == NULL) {
-        log_error("HSCAN get trace reply Failed to create cJSON object");
-        goto end;
-    }
+    /* Field names at even positions, values at odd ones */
+    sds head = sdscatlen(sdsnew("\"page\":"), cursor->str, cursor->len);
+    *out = kx_page_splice(head, sdslen(head), name,
+                          keys->element + 1, keys->elements ? keys->elements - 1 : 0, 2);
+    sdsfree(head);
+    return 0;
+}
 
-    cJSON_AddNumberToObject(root, "page", cursor);
+/* Parse HSCAN query file list
+ * Returns 0 on success, -1 otherwise */
+static int kx_hscan_files(redisReply *reply, void *data, sds *out) {
+    return kx_hscan_splice(reply, "files", out);
+}
 
-    traces = cJSON_CreateArray();
-    if (traces == NULL) {
-        log_error("Failed to create traces array");
-        goto end;
+/* ZADD replies the number of new members, 0 when the very same trace
+ * was already recorded, which is fine too.
+ * Returns 0 on success, -1 otherwise */
+static int kx_zadd_reply(redisReply *reply, void *data, sds *out) {
+    if (reply->type == REDIS_REPLY_INTEGER) {
+        *out = sdsnew(STROK);
+        return 0;
     }
-    cJSON_AddItemToObject(root, "traces", traces);
+    if (reply->type == REDIS_REPLY_ERROR)
+        log_error("redis ZADD error (%s)", reply->str);
+    return -1;
+}
 
-    if (reply->type == REDIS_REPLY_ARRAY) {
-        for (size_t i = 0; i < keys->elements; i += 2) {
-            redisReply *key = keys->element[i];
-            redisReply *value = keys->element[i + 1];
-            if (key->type == REDIS_REPLY_STRING && value->type == REDIS_REPLY_STRING) {
-                cJSON_AddItemToArray(traces, cJSON_Parse(value->str));
-                ret = 0;
-            }
+/* Parse a page of traces, member and score pairs. One more trace than
+ * a page holds is asked for, if it comes back there is a next page. It
+ * is described both as "page", the next page number, 0 when this was
+ * the last one, and as a continuation token with "has_more". Requests
+ * made with a token only get the latter.
+ *
+ * The token is the position of the last trace: its score and how many
+ * traces of that score were returned up to it. The next page starts at
+ * that score, past those traces, so it only costs the traces sharing a
+ * millisecond however deep the pages go. Traces are not told apart by
+ * their content, which need not carry an id. A page number followed by
+ * a token may repeat traces of a score the page number started within,
+ * it never skips any.
+ * Returns 0 on success, -1 otherwise */
+static int kx_zrange_traces(redisReply *reply, void *data, sds *out) {
+    Kgettrace *fg = (Kgettrace*)data;
+    char head[128];
+    int more, len = 0;
+    long long last;
+    size_t n, ties;
+
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements % 2) {
+        log_error("Invalid ZRANGEBYSCORE reply");
+        return -1;
+    }
+
+    n = reply->elements / 2;
+    more = n > server.pagenum;
+    if (more)
+        n = server.pagenum;
+    if (!fg->token)
+        len = snprintf(head, sizeof(head), "\"page\":%u,", more ? fg->page + 1 : 0);
+    if (more && n) {
+        last = strtoll(reply->element[2 * n - 1]->str, NULL, 10);
+        for (ties = 1; ties < n; ties++) {
+            if (strtoll(reply->element[2 * (n - ties) - 1]->str, NULL, 10) != last)
+                break;
         }
-        char *jstr = cJSON_Print(root);
-        *out = sdsnew(jstr);
-        free(jstr);
-    } else if (reply->type == REDIS_REPLY_NIL) {
-        *out = sdsnew(STRNOFOUND);
+        /* The whole page has the score it started at: count the traces
+         * of that score skipped to get there as well */
+        if (ties == n && last == fg->score)
+            ties += fg->offset;
+        len += snprintf(head + len, sizeof(head) - len,
+                        "\"token\":\"t%lld.%zu\",\"has_more\":true", last, ties);
+    } else {
+        len += snprintf(head + len, sizeof(head) - len, "\"token\":\"\",\"has_more\":false");
     }
-    
-end:
-    if (root) cJSON_Delete(root);
-    freeReplyObject(reply);
-    return ret;
+    *out = kx_page_splice(head, len, "traces", reply->element, 2 * n, 2);
+    return 0;
 }
 
 static redisReply *kx_command(redisContext *c, const char *cmd) {
@@ -333,317 +793,332 @@ ret:
 }
 
 
-/* Create a redis link context, create one for each 
- * link separately, and release it after use*/
-static redisContext *create_redis_ctx() {
-    redisContext *ctx = NULL;
-    struct timeval timeout = {1, 500000}; // 1.5 seconds
-
-    ctx = redisConnectWithTimeout(server.redisip, server.redisport, timeout);
-    if (ctx == NULL || ctx->err) {
-
-        if (ctx) {
-            int n = 0;
-
-            while (ctx->err & (REDIS_ERR_IO | REDIS_ERR_EOF) && n < 3) {
-                log_warn("redis failed, retrying...");
-                redisFree(ctx);
-                ctx = redisConnect(server.redisip, server.redisport);
-                n++;
-            }
+int redis_exec(Kdbtype type, void *data, sds *outdata) {
+    struct action *ac;
 
-            if (ctx == NULL || ctx->err) {
-                log_error("redis failed connect...");
-                exit(1);
-            }
-        } else {
-            log_error("redis Connection error: can't allocate redis context");
-            exit(1);
-        }
-    }
-
-    /* Set aggressive KEEP_ALIVE socket option in the Redis context socket
-    * in order to prevent timeouts caused by the execution of long
-    * commands. At the same time this improves the detection of real
-    * errors. */
-    redisKeepAlive(ctx, REDIS_CLI_KEEPALIVE_INTERVAL);
-
-    return ctx;
+    if (data == NULL || (unsigned)type >= REDIS_ACTION_MAX)
+        return -1;
+    ac = kx_action(type);
+    if (ac->npipeline)
+        return kx_pipeline_exec(ac, data, outdata);
+    return kx_action_exec(ac, data, outdata);
 }
 
-int redis_user_register(void *data, sds *outdata) {
-    struct action   *ac = NULL;
-    redisReply      *reply = NULL;
-    redisContext    *ctx;
-    Kuser           *u;
+int redis_load_scripts(void) {
+    int ret = 0;
 
-    u = (Kuser*)data;
-    if (u == NULL) {
-        return -1;
-    }
-    
-    ctx = create_redis_ctx();
-    if (ctx) {
-        ac = kx_search_action(REDIS_USER_REGISTER);
-        if (ac) {
-            reply = redisCommand(ctx,
-                                ac->cmdline, 
-                                u->machine,
-                                u->machine,
-                                u->username);
-            if (reply == NULL) {
-                redisFree(ctx);
-                return -1;
-            }
-            
-            if (ac->syncexec(reply, outdata) == 0) {
-                redisFree(ctx);
-                return 0;
-            }
-        }
-        redisFree(ctx);
+    for (int i = 0; i < ACSIZE; i++) {
+        sds out = NULL;
+
+        assert(acs[i].type == (Kdbtype)i);
+        if (acs[i].script && kx_script_load(&acs[i], &out) != 0)
+            ret = -1;
+        if (out) sdsfree(out);
     }
-    return -1;
+    return ret;
 }
 
-int redis_get_user(void *data, sds *outdata) {
-    struct action   *ac = NULL;
-    redisReply      *reply = NULL;
-    redisContext    *ctx;
-    sds             machine;
-
-    machine = (sds)data;
-    if (machine == NULL) {
-        return -1;
+/* One HGET per file not already known, all written at once and read
+ * back in a single round trip. MGET does not apply, the records live
+ * in per file hashes. */
+int redis_get_file_batch(void *data, sds *outdata) {
+    Kfilebatch      *fb = (Kfilebatch*)data;
+    struct action   *ac = kx_action(REDIS_GET_FILE);
+    char            **cmds;
+    size_t          *lens;
+    redisReply      **replies;
+    int             *index;
+    int             i, len, ncmds = 0, ret = -1;
+
+    cmds = zcalloc(sizeof(char*) * fb->n);
+    lens = zmalloc(sizeof(size_t) * fb->n);
+    replies = zcalloc(sizeof(redisReply*) * fb->n);
+    index = zmalloc(sizeof(int) * fb->n);
+
+    for (i = 0; i < fb->n; i++) {
+        if (fb->values[i])
+            continue;
+        Karg args[] = {SDSARG(fb->uuids[i])};
+        if ((len = kx_format_action(ac, args, &cmds[ncmds])) < 0)
+            goto end;
+        lens[ncmds] = len;
+        index[ncmds++] = i;
     }
 
-    ctx = create_redis_ctx();
-    if (ctx) {
-        ac = kx_search_action(REDIS_USER_GET_INFO);
-        if (ac) {
-            reply = redisCommand(ctx,
-                                ac->cmdline, 
-                                machine);
-            if (reply == NULL) {
-                redisFree(ctx);
-                return -1;
-            }
+    if (ncmds && kx_execute(cmds, lens, ncmds, replies, outdata) != 0)
+        goto end;
 
-            if (ac->syncexec(reply, outdata) == 0) {
-                redisFree(ctx);
-                return 0;
-            } 
+    for (i = 0; i < ncmds; i++) {
+        if (replies[i]->type == REDIS_REPLY_STRING) {
+            fb->values[index[i]] = kx_decode_value(replies[i]->str, replies[i]->len);
+        } else if (replies[i]->type != REDIS_REPLY_NIL) {
+            log_error("redis HGET error (%s)", replies[i]->type == REDIS_REPLY_ERROR ? replies[i]->str : "");
+            goto end;
         }
-        redisFree(ctx);
     }
-    return -1;
-}
-
-int redis_upload_file(void *data, sds *outdata) {
-    struct action   *ac = NULL;
-    redisReply      *reply = NULL;
-    redisContext    *ctx;
-    Kfile           *f;
+    ret = 0;
 
-    f = (Kfile*)data;
-    if (f == NULL) {
-        return -1;
+end:
+    for (i = 0; i < ncmds; i++) {
+        if (replies[i]) freeReplyObject(replies[i]);
+        redisFreeCommand(cmds[i]);
     }
+    zfree(cmds);
+    zfree(lens);
+    zfree(replies);
+    zfree(index);
+    return ret;
+}
 
-    ctx = create_redis_ctx();
-    if (ctx) {
-        ac = kx_search_action(REDIS_SET_FILE);
-        if (ac) {
-            reply = redisCommand(ctx,
-                                ac->cmdline, 
-                                f->uuid,
-                                f->uuid,
-                                f->data);
-            if (reply == NULL) {
-                redisFree(ctx);
-                return -1;
-            }
+/* Fill a page of exactly pagenum files, or the last files, by running
+ * HSCAN from the token position as many times as needed, at most
+ * server.page_scans times. HSCAN may return more elements than asked
+ * for, the token then records the cursor of that call and how many of
+ * its elements were already returned, so the next page asks for the
+ * same cursor again and skips them.
+ * Returns 0 on success, -1 otherwise */
+static int kx_hscan_fill(Kfileall *fs, sds *outdata) {
+    struct action       *ac = kx_action(REDIS_GET_ALL_FILES);
+    redisReply          **replies, **values;
+    redisReply          *keys;
+    unsigned long long  cursor = fs->cursor, next;
+    size_t              skip = fs->skip, i, nitems;
+    int                 nreplies = 0, more = 1, ret = -1;
+    uint32_t            count = 0;
+    char                *cmd;
+    size_t              len;
+    char                head[96];
+    int                 hlen;
+
+    replies = zcalloc(sizeof(redisReply*) * server.page_scans);
+    values = zmalloc(sizeof(redisReply*) * server.pagenum);
+
+    while (count < server.pagenum && nreplies < server.page_scans) {
+        char cbuf[NUMARG_SIZE], nbuf[NUMARG_SIZE];
+        Karg args[] = {SDSARG(fs->machine), kx_numarg(cbuf, (long long)cursor),
+                       kx_numarg(nbuf, server.pagenum - count)};
+        long long n = kx_format_action(ac, args, &cmd);
+        if (n < 0)
+            goto end;
+        len = n;
+        n = kx_execute(&cmd, &len, 1, &replies[nreplies], outdata);
+        redisFreeCommand(cmd);
+        if (n != 0)
+            goto end;
 
-            if (ac->syncexec(reply, outdata) == 0) {
-                redisFree(ctx);
-                return 0;
-            } 
+        redisReply *reply = replies[nreplies++];
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+            reply->element[0]->type != REDIS_REPLY_STRING ||
+            reply->element[1]->type != REDIS_REPLY_ARRAY) {
+            log_error("Invalid HSCAN reply");
+            goto end;
+        }
+        next = strtoull(reply->element[0]->str, NULL, 10);
+        keys = reply->element[1];
+        nitems = keys->elements / 2;
+
+        /* Field names at even positions, values at odd ones */
+        for (i = skip; i < nitems && count < server.pagenum; i++)
+            values[count++] = keys->element[i * 2 + 1];
+        if (i < nitems) {
+            /* The page is full in the middle of this call */
+            skip = i;
+            break;
+        }
+        skip = 0;
+        cursor = next;
+        if (cursor == 0) {
+            more = 0;
+            break;
         }
-        redisFree(ctx);
     }
-    return -1;
-}
-
-int redis_upload_machine_file(void *data, sds *outdata) {
-    struct action   *ac = NULL;
-    redisReply      *reply = NULL;
-    redisContext    *ctx;
-    Kfile           *f;
 
-    f = (Kfile*)data;
-    if (f == NULL) {
-        return -1;
+    if (more) {
+        hlen = snprintf(head, sizeof(head), "\"token\":\"f%llu.%zu\",\"has_more\":true", cursor, skip);
+    } else {
+        hlen = snprintf(head, sizeof(head), "\"token\":\"\",\"has_more\":false");
     }
+    *outdata = kx_page_splice(head, hlen, "files", values, count, 1);
+    ret = 0;
 
-    ctx = create_redis_ctx();
-    if (ctx) {
-        ac = kx_search_action(REDIS_SET_MACHINE_FILE);
-        if (ac) {
-            reply = redisCommand(ctx,
-                                ac->cmdline, 
-                                f->machine,
-                                f->uuid,
-                                f->data);
-            if (reply == NULL) {
-                redisFree(ctx);
-                return -1;
-            }
-
-            if (ac->syncexec(reply, outdata) == 0) {
-                redisFree(ctx);
-                return 0;
-            } 
-        }
-        redisFree(ctx);
-    }
-    return -1;
+end:
+    for (int j = 0; j < nreplies; j++)
+        freeReplyObject(replies[j]);
+    zfree(replies);
+    zfree(values);
+    return ret;
 }
 
-int redis_get_file(void *data, sds *outdata) {
-    struct action   *ac = NULL;
-    redisReply      *reply = NULL;
-    redisContext    *ctx;
-    sds             uuid;
-
-    uuid = (sds)data;
-    if (uuid == NULL) {
-        return -1;
-    }
+/* Walk the whole machine hash with HSCAN and write the file records
+ * of every call as soon as it is answered, comma separated. Only one
+ * HSCAN reply and its copy are held at a time, so memory stays flat
+ * whatever the number of files.
+ * Returns 0 on success, -1 otherwise */
+int redis_stream_fileall(void *data, Kwriter *w) {
+    Kfileall            *fs = (Kfileall*)data;
+    struct action       *ac = kx_action(REDIS_GET_ALL_FILES);
+    redisReply          *reply = NULL, *keys;
+    unsigned long long  cursor = 0;
+    char                *cmd;
+    size_t              len, count = 0;
+    sds                 chunk = sdsempty(), out = NULL;
+    int                 ret = -1;
+
+    do {
+        char cbuf[NUMARG_SIZE], nbuf[NUMARG_SIZE];
+        Karg args[] = {SDSARG(fs->machine), kx_numarg(cbuf, (long long)cursor),
+                       kx_numarg(nbuf, STREAM_SCAN_COUNT)};
+        long long n = kx_format_action(ac, args, &cmd);
+        if (n < 0)
+            goto end;
+        len = n;
+        n = kx_execute(&cmd, &len, 1, &reply, &out);
+        redisFreeCommand(cmd);
+        if (n != 0)
+            goto end;
 
-    ctx = create_redis_ctx();
-    if (ctx) {
-        ac = kx_search_action(REDIS_GET_FILE);
-        if (ac) {
-            reply = redisCommand(ctx,
-                                ac->cmdline, 
-                                uuid,
-                                uuid);
-            if (reply == NULL) {
-                redisFree(ctx);
-                return -1;
-            }
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+            reply->element[0]->type != REDIS_REPLY_STRING ||
+            reply->element[1]->type != REDIS_REPLY_ARRAY) {
+            log_error("Invalid HSCAN reply");
+            goto end;
+        }
+        cursor = strtoull(reply->element[0]->str, NULL, 10);
+        keys = reply->element[1];
+
+        /* Field names at even positions, values at odd ones */
+        sdsclear(chunk);
+        for (size_t i = 1; i < keys->elements; i += 2) {
+            if (keys->element[i]->type == REDIS_REPLY_STRING)
+                chunk = kx_cat_value(chunk, keys->element[i], &count);
+        }
+        freeReplyObject(reply);
+        reply = NULL;
 
-            if (ac->syncexec(reply, outdata) == 0) {
-                redisFree(ctx);
-                return 0;
-            } 
+        if (sdslen(chunk) && kx_writer_write(w, chunk, sdslen(chunk)) != 0) {
+            log_error("file listing of %s interrupted, the client is gone", fs->machine);
+            goto end;
         }
-        redisFree(ctx);
-    }
-    return -1;
+    } while (cursor != 0);
+    ret = 0;
+
+end:
+    if (reply) freeReplyObject(reply);
+    if (out) sdsfree(out);
+    sdsfree(chunk);
+    return ret;
 }
 
 int redis_get_fileall(void *data, sds *outdata) {
-    struct action   *ac = NULL;
-    redisReply      *reply = NULL;
-    redisContext    *ctx;
-    Kfileall        *fs;
+    Kfileall *fs = (Kfileall*)data;
 
-    fs = (Kfileall*)data;
     if (fs == NULL) {
         return -1;
     }
+    if (fs->token)
+        return kx_hscan_fill(fs, outdata);
+    return redis_exec(REDIS_GET_ALL_FILES, data, outdata);
+}
 
-    ctx = create_redis_ctx();
-    if (ctx) {
-        ac = kx_search_action(REDIS_GET_ALL_FILES);
-        if (ac) {
-            reply = redisCommand(ctx,
-                                ac->cmdline, 
-                                fs->machine,
-                                fs->page,
-                                server.pagenum);
-            if (reply == NULL) {
-                redisFree(ctx);
-                return -1;
-            }
+static int kx_trace_cmp(const void *a, const void *b) {
+    const Ktrace *x = *(const Ktrace **)a, *y = *(const Ktrace **)b;
+    int cmp = strcmp(x->uuid, y->uuid);
 
-            if (ac->syncexec(reply, outdata) == 0) {
-                redisFree(ctx);
-                return 0;
-            } 
-        }
-        redisFree(ctx);
-    }
-    return -1;
+    /* same file: keep the request order, the traces are in one array */
+    if (cmp == 0)
+        cmp = x < y ? -1 : 1;
+    return cmp;
 }
 
-int redis_set_trace(void *data, sds *outdata) {
-    struct action   *ac = NULL;
-    redisReply      *reply = NULL;
-    redisContext    *ctx;
-    Ktrace          *ft;
-
-    ft = (Ktrace*)data;
-    if (ft == NULL) {
-        return -1;
+/* The traces are grouped by file and each file gets a single
+ *
+ * ZADD trace:fileuuid ms1 member1 ms2 member2 ...
+ *
+ * All the ZADDs are written at once and their replies read back in one
+ * round trip, so a batch costs the same as a single trace to redis
+ * whatever the number of files it touches. There is no MULTI: a ZADD is
+ * atomic on its own and a failing file does not hold back the others. */
+int redis_set_trace_batch(void *data, sds *outdata) {
+    Ktracebatch     *tb = (Ktracebatch*)data;
+    Ktrace          **sorted;
+    const char      **argv;
+    size_t          *argvlen;
+    char            (*scores)[21];
+    char            **cmds;
+    size_t          *lens;
+    redisReply      **replies;
+    int             *first;
+    int             i, j, n = 0, ngroups = 0, argc, ret = -1;
+    long long       len;
+
+    sorted = zmalloc(sizeof(Ktrace*) * tb->ntraces);
+    for (i = 0; i < tb->ntraces; i++) {
+        if (tb->status[i] == 0)
+            sorted[n++] = &tb->traces[i];
     }
-
-    ctx = create_redis_ctx();
-    if (ctx) {
-        ac = kx_search_action(REDIS_SET_TRACE);
-        if (ac) {
-            reply = redisCommand(ctx,
-                                ac->cmdline, 
-                                ft->uuid,
-                                ft->tracefield,
-                                ft->data);
-            if (reply == NULL) {
-                redisFree(ctx);
-                return -1;
-            }
-
-            if (ac->syncexec(reply, outdata) == 0) {
-                redisFree(ctx);
-                return 0;
-            } 
+    if (n == 0) {
+        zfree(sorted);
+        return 0;
+    }
+    qsort(sorted, n, sizeof(Ktrace*), kx_trace_cmp);
+
+    argv = zmalloc(sizeof(char*) * (2 + 2 * n));
+    argvlen = zmalloc(sizeof(size_t) * (2 + 2 * n));
+    scores = zmalloc(sizeof(*scores) * n);
+    cmds = zcalloc(sizeof(char*) * n);
+    lens = zmalloc(sizeof(size_t) * n);
+    replies = zcalloc(sizeof(redisReply*) * n);
+    first = zmalloc(sizeof(int) * (n + 1));
+
+    for (i = 0; i < n; i = j) {
+        sds key = sdscatsds(sdsnew("trace:"), sorted[i]->uuid);
+
+        argv[0] = "ZADD";
+        argvlen[0] = 4;
+        argv[1] = key;
+        argvlen[1] = sdslen(key);
+        argc = 2;
+        for (j = i; j < n && strcmp(sorted[j]->uuid, sorted[i]->uuid) == 0; j++) {
+            argvlen[argc] = snprintf(scores[j], sizeof(scores[j]), "%lld", sorted[j]->score);
+            argv[argc++] = scores[j];
+            /* Stored plain like REDIS_SET_TRACE, to keep the id order */
+            argvlen[argc] = sdslen(sorted[j]->data);
+            argv[argc++] = sorted[j]->data;
         }
-        redisFree(ctx);
+        len = redisFormatCommandArgv(&cmds[ngroups], argc, argv, argvlen);
+        sdsfree(key);
+        if (len < 0)
+            goto end;
+        lens[ngroups] = len;
+        first[ngroups++] = i;
     }
-    return -1;
-}
+    first[ngroups] = n;
 
-int redis_get_trace(void *data, sds *outdata) {
-    struct action   *ac = NULL;
-    redisReply      *reply = NULL;
-    redisContext    *ctx = NULL;
-    Kgettrace       *fg;
+    if (kx_execute(cmds, lens, ngroups, replies, outdata) != 0)
+        goto end;
 
-    fg = (Kgettrace*)data;
-    if (fg == NULL) {
-        return -1;
+    ret = 0;
+    for (i = 0; i < ngroups; i++) {
+        if (replies[i]->type == REDIS_REPLY_INTEGER)
+            continue;
+        if (replies[i]->type == REDIS_REPLY_ERROR)
+            log_error("redis ZADD error (%s)", replies[i]->str);
+        for (j = first[i]; j < first[i + 1]; j++)
+            tb->status[sorted[j] - tb->traces] = -1;
     }
 
-    ctx = create_redis_ctx();
-    if (ctx) {
-        ac = kx_search_action(REDIS_GET_TRACE);
-        if (ac) {
-            reply = redisCommand(ctx,
-                                ac->cmdline, 
-                                fg->uuid,
-                                fg->page,
-                                server.pagenum);
-            if (reply == NULL) {
-                redisFree(ctx);
-                return -1;
-            }
-            
-            if (ac->syncexec(reply, outdata) == 0) {
-                redisFree(ctx);
-                return 0;
-            } 
-        }
-        redisFree(ctx);
+end:
+    for (i = 0; i < ngroups; i++) {
+        if (replies[i]) freeReplyObject(replies[i]);
+        redisFreeCommand(cmds[i]);
     }
-    return -1;
-}
\ No newline at end of file
+    zfree(sorted);
+    zfree(argv);
+    zfree(argvlen);
+    zfree(scores);
+    zfree(cmds);
+    zfree(lens);
+    zfree(replies);
+    zfree(first);
+    return ret;
+}
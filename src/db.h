@@ -28,68 +28,114 @@
 #ifndef __DB__
 #define __DB__
 
+/* Redis actions, with the request data each one is run on */
 typedef enum Kdbtype {
-    REDIS_USER_REGISTER,        /* User registration */
-    REDIS_USER_GET_INFO,        /* Get individual user information */
+    REDIS_USER_REGISTER,        /* User registration, Kuser */
+    REDIS_USER_GET_INFO,        /* Get individual user information, machine sds */
     REDIS_USER_GET_ALL_INFO,
-    REDIS_SET_FILE,             /* upload Encrypt file information*/
-    REDIS_SET_MACHINE_FILE,     /* Record all files belonging to the same machine */
-    REDIS_GET_FILE,             /* Get information about a single encrypted file */
-    REDIS_GET_ALL_FILES,        /* Get all encrypted file information */
-    REDIS_SET_TRACE,            /* Upload traceability information */
-    REDIS_GET_TRACE             /* Get traceability information */
+    REDIS_SET_FILE,             /* upload Encrypt file information, Kfile */
+    REDIS_SET_MACHINE_FILE,     /* Record all files belonging to the same machine, Kfile */
+    REDIS_GET_FILE,             /* Get information about a single encrypted file, uuid sds */
+    REDIS_GET_ALL_FILES,        /* Get a page of encrypted file information, Kfileall */
+    REDIS_SET_TRACE,            /* Upload traceability information, Ktrace */
+    REDIS_GET_TRACE,            /* Get a page of traceability information, Kgettrace */
+    REDIS_SAVE_FILE,            /* REDIS_SET_FILE and REDIS_SET_MACHINE_FILE in one transaction, Kfile */
+    REDIS_USER_UPSERT,          /* Get a user, registering it if missing, in one script call.
+                                 * Kuser, created is set if it was registered */
+    REDIS_ACTION_MAX
 } Kdbtype;
 
-typedef int (*synccallback)(redisReply *c, sds *out);
+#define ACTION_MAX_PIPELINE 4
+#define ACTION_MAX_ARGV     8
+
+/* A value given to a command, binary safe */
+typedef struct Karg {
+    const char *ptr;
+    size_t len;
+} Karg;
+
+#define ARG_NONE    -1      /* Literal argument */
+#define ARG_SHA     -2      /* sha1 of the script of the action */
+
+/* Where an argument value is read from in the request data */
+typedef enum Kargtype {
+    KARG_NONE,      /* End of the arguments */
+    KARG_DATA,      /* The request data is itself an sds */
+    KARG_SDS,       /* sds member */
+    KARG_VALUE,     /* sds member stored with the redis-compression codec */
+    KARG_LLONG,     /* long long member */
+    KARG_UINT32,    /* uint32_t member */
+    KARG_PAGENUM    /* server.pagenum plus 'offset' */
+} Kargtype;
+
+typedef struct Kfield {
+    Kargtype type;
+    size_t offset;
+} Kfield;
+
+/* One argument of a command template: the literal 'prefix' followed
+ * by the value of argument number 'arg', if there is one. */
+typedef struct Kargtpl {
+    const char *prefix;
+    size_t prefixlen;
+    int arg;
+} Kargtpl;
+
+struct Kwriter;
+
+/* Parse a reply into the output data. The reply stays owned by the
+ * caller, data is the request object the command was built from. */
+typedef int (*synccallback)(redisReply *c, void *data, sds *out);
 struct action {
     Kdbtype type;
-    char *cmdline;
+    /* Command template, up to the first NULL prefix. Commands are built
+     * with redisFormatCommandArgv from the values given, no format string
+     * is parsed and no length is computed at run time. */
+    Kargtpl argv[ACTION_MAX_ARGV];
+    /* Argument number n of argv is read from args[n] of the request
+     * data, up to the first KARG_NONE */
+    Kfield args[ACTION_MAX_ARGV];
     synccallback syncexec;
+    /* A pipeline action has no command of its own: it queues the actions
+     * listed in 'pipeline' on one connection, optionally wrapped in
+     * MULTI/EXEC, and reads all the replies in a single round trip. */
+    int multi;
+    int npipeline;
+    Kdbtype pipeline[ACTION_MAX_PIPELINE];
+    /* A scripted action runs a Lua script with EVALSHA, the ARG_SHA
+     * argument of its template. The script is loaded with SCRIPT LOAD at
+     * startup, or on first use if redis was not reachable, and again
+     * whenever redis answers NOSCRIPT. */
+    const char *script;
+    sds sha;                    /* sha1 of the script, once loaded */
 };
 
-/** @brief Save registered user data
+/** @brief Run a redis action on the request data, see Kdbtype for
+ *         the data each action expects
  * 
- * @param data struct User object
+ * @param type Action to run
+ * @param data Request data the command arguments are read from
  * @param outdate Output data in json format
  * @return Returns 0 on success, -1 otherwise
  */
-int redis_user_register(void *data, sds *outdata);
+int redis_exec(Kdbtype type, void *data, sds *outdata);
 
-/** @brief Get user information
+/** @brief Load the Lua scripts of the scripted actions into redis
  * 
- * @param data struct User object
- * @param outdate Output data in json format
- * @return Returns 0 on success, -1 otherwise
+ * @return Returns 0 on success, -1 if a script could not be loaded
+ *         yet, it will be loaded on first use
  */
-int redis_get_user(void *data, sds *outdata);
+int redis_load_scripts(void);
 
-/** @brief Record the information of a single encrypted file 
- *         so that it can be easily obtained when querying the owner.
+/** @brief Obtain the information of several encrypted files with
+ *         one pipelined round trip
  * 
- * @param data struct file object
- * @param outdate Output data in json format
+ * @param data Kfilebatch object, the records of the files without
+ *             one are filled in, those not found are left NULL
+ * @param outdate Set to an error if redis could not be reached
  * @return Returns 0 on success, -1 otherwise
  */
-int redis_upload_file(void *data, sds *outdata);
-
-/** @brief Record encrypted files on the same machine. 
- *         In order to recover data, it is generally used 
- *         together with the redis_upload_file interface.
- * 
- * @param data struct file object
- * @param outdate Output data in json format
- * @return Returns 0 on success, -1 otherwise
- */
-int redis_upload_machine_file(void *data, sds *outdata);
-
-/** @brief Obtain the information of a single encrypted file 
- *         and call it when the file applies for authorization.
- * 
- * @param data file uuid
- * @param outdate Output data in json format
- * @return Returns 0 on success, -1 otherwise
- */
-int redis_get_file(void *data, sds *outdata);
+int redis_get_file_batch(void *data, sds *outdata);
 
 /** @brief Get information about all encrypted files on a machine
  * 
@@ -99,20 +145,22 @@ int redis_get_file(void *data, sds *outdata);
  */
 int redis_get_fileall(void *data, sds *outdata);
 
-/** @brief Upload traceability information
+/** @brief Write the records of all encrypted files of a machine,
+ *         comma separated, as they are read from redis
  * 
- * @param data Ktrace object
- * @param outdate Output data in json format
+ * @param data Kfileall object
+ * @param w Destination of the records
  * @return Returns 0 on success, -1 otherwise
  */
-int redis_set_trace(void *data, sds *outdata);
+int redis_stream_fileall(void *data, struct Kwriter *w);
 
-/** @brief Get traceability information
+/** @brief Upload traceability information of several files at once,
+ *         with one ZADD per file sent in a single pipeline
  * 
- * @param data Kfileall object
- * @param outdate Output data in json format
- * @return Returns 0 on success, -1 otherwise
+ * @param data Ktracebatch object, the status of every trace is updated
+ * @param outdate Set to an error if redis could not be reached
+ * @return Returns 0 if the batch reached redis, -1 otherwise
  */
-int redis_get_trace(void *data, sds *outdata);
+int redis_set_trace_batch(void *data, sds *outdata);
 
 #endif
\ No newline at end of file
@@ -37,6 +37,7 @@
 #include <openssl/ssl.h>
 
 #include "kserver.h"
+#include "atomicvar.h"
 
 
 
@@ -66,12 +67,15 @@ static void stopServer();
 static int ksresponse(struct mg_connection *conn, 
                         const void *buf,
                         size_t len,
-                        int status);
+                        int status,
+                        const char *type,
+                        const char *encoding);
 static void init_system_info(void);
 
 static int log_message_cb(const struct mg_connection *conn, const char *message);
 static void connection_close_cb(const struct mg_connection *conn);
 static int request_handler(struct mg_connection *conn, void *cbdata);
+static int metrics_handler(struct mg_connection *conn, void *cbdata);
 static void send_directory_listing(struct mg_connection *conn, const char *dir);
 
 /**************************CERT**************************************/
@@ -317,20 +321,57 @@ struct ApiEntry ApiTable[] = {
     // {"/userget", "POST", kx_user_get},
     {"/fileset", "POST", kx_file_set},
     {"/fileget", "POST", kx_file_get},
+    {"/fileget/batch", "POST", kx_file_get_batch},
     {"/filegetall", "POST", kx_file_getall},
+    {"/filegetall/stream", "POST", NULL, kx_file_getall_stream},
     {"/filesettrace", "POST", kx_trace_set},
+    {"/filesettrace/batch", "POST", kx_trace_set_batch},
     {"/filegettrace", "POST", kx_trace_get}
 };
 
-static struct ApiEntry *getApiFunc(const char *uri, const char *method) {
-    int i;
-    int num = sizeof(ApiTable) / sizeof(struct ApiEntry);
+#define API_NUM (sizeof(ApiTable) / sizeof(struct ApiEntry))
+#define API_INDEX_SIZE 64   /* Power of two, keep it well above API_NUM */
+
+/* Open addressing hash index of ApiTable keyed by URI, built once at
+ * startup, so finding the entry of a request costs one hash of the URI
+ * and normally a single strcmp however many APIs are registered. */
+static struct ApiEntry *ApiIndex[API_INDEX_SIZE];
+
+/* Statistics of the requests that matched no API */
+static Kstats UnknownApiStats;
+
+static unsigned int api_hash(const char *uri) {
+    return fnv1aHash(uri, strlen(uri));
+}
+
+static void initApiIndex(void) {
+    assert(API_NUM * 2 <= API_INDEX_SIZE);
+
+    for (int i = 0; i < API_NUM; i++) {
+        unsigned int slot = api_hash(ApiTable[i].uri) & (API_INDEX_SIZE - 1);
+
+        while (ApiIndex[slot])
+            slot = (slot + 1) & (API_INDEX_SIZE - 1);
+        ApiIndex[slot] = &ApiTable[i];
+    }
+}
+
+/* Find the API serving uri and method. If the URI exists but not for
+ * this method *status is set to HTTP_NOTALLOWED, HTTP_NOFOUND if the
+ * URI is unknown. */
+static struct ApiEntry *getApiFunc(const char *uri, const char *method, int *status) {
+    unsigned int slot = api_hash(uri) & (API_INDEX_SIZE - 1);
 
-    for (i = 0; i < num; i++) {
-        struct ApiEntry *api = ApiTable + i;
-        if (strcmp(uri, api->uri) == 0
-            && strcmp(method, api->method) == 0)
-            return api;
+    *status = HTTP_NOFOUND;
+    while (ApiIndex[slot]) {
+        struct ApiEntry *api = ApiIndex[slot];
+
+        if (strcmp(uri, api->uri) == 0) {
+            if (strcmp(method, api->method) == 0)
+                return api;
+            *status = HTTP_NOTALLOWED;
+        }
+        slot = (slot + 1) & (API_INDEX_SIZE - 1);
     }
     return NULL;
 }
@@ -386,16 +427,32 @@ static void init_system_info(void) {
 	}
 }
 
+/* Sampling rate of the high volume info logs, sampling is off while
+ * the log is made more verbose with SIGUSR1. */
+static unsigned logSampleRate(void) {
+    int verbose;
+
+    atomicGet(server.log_verbose, verbose);
+    return verbose ? 1 : server.log_sample_rate;
+}
+
 static int log_message_cb(const struct mg_connection *conn, const char *message) {
     log_info("http info (%s)", message);
     return 1;
 }
 
+static int init_connection_cb(const struct mg_connection *conn, void **conn_data) {
+    atomicIncr(server.clients, 1);
+    return 0;
+}
+
 static void connection_close_cb(const struct mg_connection *conn) {
     const struct mg_request_info *ri = NULL;
+
+    atomicDecr(server.clients, 1);
     ri = mg_get_request_info(conn);
     if (ri && ri->local_uri)
-        log_info("(%s) connect close", ri->local_uri);
+        log_sampled(LOG_INFO, logSampleRate(), "(%s) connect close", ri->local_uri);
 }
 
 static int http_error(struct mg_connection *conn, 
@@ -410,11 +467,15 @@ static int http_error(struct mg_connection *conn,
  * conn : Created link object
  * buf : Information sent to the client
  * len : info length
- * status : status code*/
+ * status : status code
+ * type : Content-Type of buf
+ * encoding : Content-Encoding of buf, NULL if not compressed*/
 static int ksresponse(struct mg_connection *conn, 
                         const void *buf,
                         size_t len,
-                        int status)
+                        int status,
+                        const char *type,
+                        const char *encoding)
 {
     int ret;
     char len_text[32];
@@ -427,13 +488,27 @@ static int ksresponse(struct mg_connection *conn,
     
     ret = mg_response_header_add(conn,
 	                       "Content-Type",
-	                       "application/json; charset=utf-8",
+	                       type,
 	                       -1);
     if (ret != 0) {
         log_error("mg_response_header_add error (%d)", ret);
         goto err;
     }
 
+    if (encoding) {
+        if ((ret = mg_response_header_add(conn, "Content-Encoding", encoding, -1)) != 0) {
+            log_error("mg_response_header_add error (%d)", ret);
+            goto err;
+        }
+    }
+    if (server.compression) {
+        /* The body depends on Accept-Encoding, caches must know */
+        if ((ret = mg_response_header_add(conn, "Vary", "Accept-Encoding", -1)) != 0) {
+            log_error("mg_response_header_add error (%d)", ret);
+            goto err;
+        }
+    }
+
     sprintf(len_text, "%lu", len);
     if ((ret = mg_response_header_add(conn, "Content-Length", len_text, -1)) != 0) {
         log_error("mg_response_header_add error (%d)", ret);
@@ -457,6 +532,148 @@ err:
     return -1;
 }
 
+/* Returns 1 if the query string contains the parameter 'name',
+ * with or without a value ("pretty", "pretty=1"). */
+static int query_has_param(const char *qs, const char *name) {
+    size_t len = strlen(name);
+
+    while (qs && *qs) {
+        if (strncmp(qs, name, len) == 0
+            && (qs[len] == '\0' || qs[len] == '&' || qs[len] == '='))
+            return 1;
+        qs = strchr(qs, '&');
+        if (qs) qs++;
+    }
+    return 0;
+}
+
+/* Responses and stored data are compact JSON. For debugging, a request
+ * with ?pretty gets its response re-printed with indentation. The
+ * response is returned unchanged if it is not JSON. */
+static sds pretty_response(sds response) {
+    cJSON *root;
+    char *jstr;
+
+    root = cJSON_ParseWithLength(response, sdslen(response));
+    if (root == NULL)
+        return response;
+
+    jstr = cJSON_Print(root);
+    if (jstr) {
+        sdsfree(response);
+        response = sdsnew(jstr);
+        cJSON_free(jstr);
+    }
+    cJSON_Delete(root);
+    return response;
+}
+
+/* Read the whole request body into an sds string.
+ *
+ * When the client sent a Content-Length the buffer is sized once and
+ * filled until that many bytes arrived, since a single mg_read may
+ * return less than asked for. Otherwise (chunked transfer) the body is
+ * read until its end, growing the buffer as needed. In both cases the
+ * body may not exceed max_request_size bytes.
+ *
+ * Returns the body, or NULL with *status set to the HTTP error to
+ * answer with. */
+static sds read_request_body(struct mg_connection *conn,
+                             const struct mg_request_info *ri,
+                             int *status)
+{
+    sds body;
+    int nread;
+    size_t want;
+
+    if (ri->content_length > server.max_request_size) {
+        *status = HTTP_TOOLARGE;
+        return NULL;
+    }
+
+    body = sdsempty();
+    if (ri->content_length > 0)
+        body = sdsMakeRoomFor(body, ri->content_length);
+
+    while (1) {
+        if (ri->content_length >= 0) {
+            want = ri->content_length - sdslen(body);
+            if (want == 0)
+                break;
+        } else {
+            /* Read at most one byte past the limit: a body of exactly
+             * max_request_size bytes is accepted, one more is not. */
+            if ((long long)sdslen(body) > server.max_request_size) {
+                sdsfree(body);
+                *status = HTTP_TOOLARGE;
+                return NULL;
+            }
+            body = sdsMakeRoomFor(body, HTTP_READ_CHUNK);
+            want = sdsavail(body);
+            if ((long long)want > server.max_request_size - (long long)sdslen(body) + 1)
+                want = server.max_request_size - sdslen(body) + 1;
+        }
+
+        nread = mg_read(conn, body + sdslen(body), want);
+        if (nread <= 0)
+            break;
+        sdsIncrLen(body, nread);
+    }
+
+    if (ri->content_length >= 0 && (long long)sdslen(body) != ri->content_length) {
+        log_error("(%s) request body truncated, %zu of %lld bytes",
+                  ri->local_uri, sdslen(body), ri->content_length);
+        sdsfree(body);
+        *status = HTTP_BADREQUEST;
+        return NULL;
+    }
+    return body;
+}
+
+struct streamCtx {
+    struct mg_connection *conn;
+    int started;                /* Set once the header is sent */
+};
+
+static int streamWrite(void *ctx, const char *buf, size_t len) {
+    struct streamCtx *sc = ctx;
+
+    if (!sc->started) {
+        if (mg_send_http_ok(sc->conn, "application/json; charset=utf-8", -1) < 0)
+            return -1;
+        sc->started = 1;
+    }
+    return mg_send_chunk(sc->conn, buf, (unsigned int)len) > 0 ? 0 : -1;
+}
+
+/* Answer with a response of unknown length, sent with chunked transfer
+ * encoding while the API produces it. The header goes out with the first
+ * write, an API failing before it is answered as usual. Once it is out
+ * the status can not change anymore, the API reports late failures in
+ * the body.
+ * Returns the HTTP status, 0 if the client is gone. */
+static int streamResponse(struct mg_connection *conn, struct ApiEntry *api,
+                          sds body, Ksample *sample) {
+    struct streamCtx sc = {conn, 0};
+    Kwriter w = {streamWrite, &sc, 0};
+    int ret;
+
+    ret = api->sfunc(body, sdslen(body), &w);
+    sample->bytes_out = w.bytes;
+    if (ret != 0)
+        sample->error = 1;
+    if (sc.started) {
+        /* The last, empty, chunk */
+        return mg_send_chunk(conn, "", 0) < 0 ? 0 : HTTP_OK;
+    }
+
+    sds response = sdsnew(STRFAIL);
+    ret = ksresponse(conn, response, sdslen(response), HTTP_OK, "application/json; charset=utf-8", NULL);
+    sample->bytes_out = sdslen(response);
+    sdsfree(response);
+    return ret == -1 ? 0 : HTTP_OK;
+}
+
 /* mg_request_handler
 
    Called when a new request comes in.  This callback is URI based
@@ -473,47 +690,184 @@ static int
 request_handler(struct mg_connection *conn, void *cbdata) {
 	int status;
     sds response = NULL;
-    char buf[MAXLEN] = {0};
+    sds body = NULL;
     struct ApiEntry *api = NULL;
     const struct mg_request_info *ri = NULL;
-    size_t uri_len;
+    const char *content, *encoding = NULL;
     size_t content_len;
+    Ksample sample = {{0}};
+    long long start, parsed, handled, written;
+    int streamed = 0;
     
+    start = kx_metrics_now();
+    kx_metrics_redis_take();
+
     /* Get the URI from the request info. */
     ri = mg_get_request_info(conn);
-    uri_len = strlen(ri->local_uri);
 
-    if (uri_len <= 100) {
+    api = getApiFunc(ri->local_uri, ri->request_method, &status);
+    /* The memory of the request is released at once when it is done.
+     * A streamed response frees its chunks as it goes and would only
+     * make the arena grow, it stays on the heap. */
+    if (api == NULL || api->sfunc == NULL)
+        kx_arena_begin();
+    if (api) {
         status = HTTP_OK; /* 200 = OK */
+        if (ri->content_length != 0) {
+            body = read_request_body(conn, ri, &status);
+        }
+        parsed = kx_metrics_now();
 
-        api = getApiFunc(ri->local_uri, ri->request_method);
-        if (api && ri->content_length > 0) {
-            mg_read(conn, buf, sizeof(buf));
-
+        if (body && sdslen(body) > 0 && api->sfunc) {
+            sample.bytes_in = sdslen(body);
+            status = streamResponse(conn, api, body, &sample);
+            streamed = 1;
+        } else if (body && sdslen(body) > 0) {
             /* The return data must be released here, 
              * otherwise a memory leak will occur */
-            response = api->jfunc(buf, strlen(buf));
+            sample.bytes_in = sdslen(body);
+            response = api->jfunc(body, sdslen(body));
+        } else if (body == NULL && status != HTTP_OK) {
+            response = sdsnew(STRFAIL);
         } else {
             status = HTTP_NOFOUND;
             response = sdsnew(STRFAIL);
         }
     } else {
-        status = HTTP_NOFOUND; /* 404 = Not Found */
-        /* We don't like this URL */
+        /* 404 for an unknown URI, 405 for a known one
+         * called with the wrong method */
+        parsed = kx_metrics_now();
         response = sdsnew(STRFAIL);
     }
+    if (body) sdsfree(body);
+    if (streamed) {
+        /* Records were written while redis was scanned, there is
+         * no separate write phase. */
+        handled = written = kx_metrics_now();
+        goto done;
+    }
+    sample.error = status != HTTP_OK
+                   || strcmp(response, STRFAIL) == 0
+                   || strcmp(response, STRERROR) == 0;
+    if (query_has_param(ri->query_string, "pretty"))
+        response = pretty_response(response);
+    content = response;
     content_len = sdslen(response);
+    if (server.compression && content_len >= server.compression_min_size) {
+        int coding = kx_compress_negotiate(mg_get_header(conn, "Accept-Encoding"));
+        const char *compressed;
+        size_t clen;
+
+        if (coding != COMPRESS_NONE &&
+            (compressed = kx_compress(coding, response, content_len, &clen)) != NULL) {
+            content = compressed;
+            content_len = clen;
+            encoding = kx_compress_name(coding);
+        }
+    }
+    handled = kx_metrics_now();
     
     /* Returns:
      * 0: the handler could not handle the request, so fall through.
      * 1 - 999: the handler processed the request. The return code is
      * stored as a HTTP status code for the access log. */
-	if (ksresponse(conn, response, content_len, status) != -1) {
-        sdsfree(response);
-        return status;
+	if (ksresponse(conn, content, content_len, status, "application/json; charset=utf-8", encoding) != -1) {
+        sample.bytes_out = content_len;
+    } else {
+        sample.error = 1;
+        status = 0;
     }
+    written = kx_metrics_now();
     sdsfree(response);
-    return 0;
+
+done:
+    sample.phase[PHASE_PARSE] = parsed - start;
+    sample.phase[PHASE_REDIS] = kx_metrics_redis_take();
+    sample.phase[PHASE_SERIALIZE] = handled - parsed - sample.phase[PHASE_REDIS];
+    sample.phase[PHASE_WRITE] = written - handled;
+    sample.phase[PHASE_TOTAL] = written - start;
+    kx_metrics_record(api ? &api->stats : &UnknownApiStats, &sample);
+    log_sampled(LOG_DEBUG, logSampleRate(), "(%s) %s %d, %lld us",
+                ri->local_uri, ri->request_method, status, sample.phase[PHASE_TOTAL]);
+    kx_arena_end();
+    return status;
+}
+
+/* GET /metrics: request counters and latency quantiles of every API,
+ * and server wide gauges, in the Prometheus text format. */
+static int metrics_handler(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *ri = mg_get_request_info(conn);
+    const char *names[API_NUM + 1];
+    Kstats *stats[API_NUM + 1];
+    uint64_t clients;
+    sds s;
+    int status = HTTP_OK;
+
+    if (strcmp(ri->request_method, "GET") != 0) {
+        s = sdsnew(STRFAIL);
+        status = ksresponse(conn, s, sdslen(s), HTTP_NOTALLOWED, "application/json; charset=utf-8", NULL);
+        sdsfree(s);
+        return status == -1 ? 0 : status;
+    }
+
+    for (int i = 0; i < API_NUM; i++) {
+        names[i] = ApiTable[i].uri;
+        stats[i] = &ApiTable[i].stats;
+    }
+    /* Requests for a URI that is not an API */
+    names[API_NUM] = "other";
+    stats[API_NUM] = &UnknownApiStats;
+
+    s = kx_metrics_cat(sdsempty(), API_NUM + 1, names, stats);
+
+    atomicGet(server.clients, clients);
+    s = sdscatprintf(s, "# HELP kserver_connected_clients Open client connections.\n"
+                        "# TYPE kserver_connected_clients gauge\n"
+                        "kserver_connected_clients %" PRIu64 "\n", clients);
+    if (server.filecache) {
+        uint64_t hits, misses;
+        unsigned long entries;
+
+        kx_cache_stats(server.filecache, &hits, &misses, &entries);
+        s = sdscatprintf(s, "# HELP kserver_file_cache_hits_total /fileget answers served from memory.\n"
+                            "# TYPE kserver_file_cache_hits_total counter\n"
+                            "kserver_file_cache_hits_total %" PRIu64 "\n"
+                            "# HELP kserver_file_cache_misses_total /fileget lookups that went to redis.\n"
+                            "# TYPE kserver_file_cache_misses_total counter\n"
+                            "kserver_file_cache_misses_total %" PRIu64 "\n"
+                            "# HELP kserver_file_cache_entries Files currently cached.\n"
+                            "# TYPE kserver_file_cache_entries gauge\n"
+                            "kserver_file_cache_entries %lu\n",
+                        hits, misses, entries);
+    }
+
+    size_t allocated, active, resident;
+    zmalloc_get_allocator_info(&allocated, &active, &resident);
+    s = sdscatprintf(s, "# HELP kserver_allocator_info Memory allocator the server was built with.\n"
+                        "# TYPE kserver_allocator_info gauge\n"
+                        "kserver_allocator_info{allocator=\"%s\"} 1\n"
+                        "# HELP kserver_memory_used_bytes Memory allocated through zmalloc.\n"
+                        "# TYPE kserver_memory_used_bytes gauge\n"
+                        "kserver_memory_used_bytes %zu\n"
+                        "# HELP kserver_memory_rss_bytes Resident set size of the process.\n"
+                        "# TYPE kserver_memory_rss_bytes gauge\n"
+                        "kserver_memory_rss_bytes %zu\n"
+                        "# HELP kserver_allocator_allocated_bytes Memory in use, as seen by the allocator.\n"
+                        "# TYPE kserver_allocator_allocated_bytes gauge\n"
+                        "kserver_allocator_allocated_bytes %zu\n"
+                        "# HELP kserver_allocator_active_bytes Memory in pages holding allocations.\n"
+                        "# TYPE kserver_allocator_active_bytes gauge\n"
+                        "kserver_allocator_active_bytes %zu\n"
+                        "# HELP kserver_allocator_resident_bytes Memory the allocator holds from the system.\n"
+                        "# TYPE kserver_allocator_resident_bytes gauge\n"
+                        "kserver_allocator_resident_bytes %zu\n",
+                    ZMALLOC_LIB, zmalloc_used_memory(), zmalloc_get_rss(),
+                    allocated, active, resident);
+
+    if (ksresponse(conn, s, sdslen(s), status, "text/plain; version=0.0.4", NULL) == -1)
+        status = 0;
+    sdsfree(s);
+    return status;
 }
 
 static int apidoc_handle_request(struct mg_connection *conn, void *cbdata) {
@@ -522,7 +876,7 @@ static int apidoc_handle_request(struct mg_connection *conn, void *cbdata) {
 
     const struct mg_request_info *request_info = mg_get_request_info(conn);
     snprintf(path, sizeof(path), "%s", request_info->local_uri);
-    log_info("(%s) api request.", path);
+    log_sampled(LOG_INFO, logSampleRate(), "(%s) api request.", path);
 
     if (stat(path+1, &st) == 0 && S_ISDIR(st.st_mode)) {
         send_directory_listing(conn, path+1);
@@ -553,6 +907,22 @@ static void sigShutdownHandler(int sig) {
     exit(1);
 }
 
+/* SIGUSR1 makes the log one level more verbose per signal and turns
+ * sampling off, to see what happens during an incident without a
+ * restart. SIGUSR2 restores the configured level and sampling. */
+static void sigLogLevelHandler(int sig) {
+    if (sig == SIGUSR1) {
+        int level = log_get_level();
+
+        if (level > LOG_TRACE)
+            log_set_level(level - 1);
+        atomicSet(server.log_verbose, 1);
+    } else {
+        log_set_level(server.loglevel);
+        atomicSet(server.log_verbose, 0);
+    }
+}
+
 void setupSignalHandlers(void) {
     struct sigaction act;
     
@@ -564,18 +934,48 @@ void setupSignalHandlers(void) {
     sigaction(SIGTERM, &act, NULL);
     sigaction(SIGINT, &act, NULL);
 
+    act.sa_flags = SA_RESTART;
+    act.sa_handler = sigLogLevelHandler;
+    sigaction(SIGUSR1, &act, NULL);
+    sigaction(SIGUSR2, &act, NULL);
+
     return;
 }
 
 static void initServerConfig(void) {
     server.redisip = zstrdup(CONFIG_REDIS_IP);
     server.redisport = CONFIG_REDIS_PORT;
+    server.node_id = CONFIG_NODE_ID;
     server.pagenum = REDIS_PAGENUM;
+    server.page_scans = CONFIG_REDIS_PAGE_SCANS;
+    server.redis_pool_size = CONFIG_REDIS_POOL_SIZE;
+    server.redis_pool_idle = CONFIG_REDIS_POOL_IDLE;
+    server.redis_pool_check = CONFIG_REDIS_POOL_CHECK;
+    server.redis_pool_wait = CONFIG_REDIS_POOL_WAIT;
+    server.redis_backoff_min = CONFIG_REDIS_BACKOFF_MIN;
+    server.redis_backoff_max = CONFIG_REDIS_BACKOFF_MAX;
+    server.redis_compression = CONFIG_REDIS_COMPRESSION;
+    server.redis_async = CONFIG_REDIS_ASYNC;
+    server.redis_async_conns = CONFIG_REDIS_ASYNC_CONNS;
     server.httpport = zstrdup(HTTP_PORT);
     server.request_timeout = zstrdup(HTTP_REQUEST_MS);
+    server.max_request_size = CONFIG_MAX_REQUEST_SIZE;
+    server.compression = CONFIG_COMPRESSION;
+    server.compression_min_size = CONFIG_COMPRESSION_MIN_SIZE;
+    server.compression_level = CONFIG_COMPRESSION_LEVEL;
+    server.request_arena_size = CONFIG_REQUEST_ARENA_SIZE;
+    server.filecache = NULL;
+    server.file_cache_size = CONFIG_FILE_CACHE_SIZE;
+    server.file_cache_ttl = CONFIG_FILE_CACHE_TTL;
     server.daemonize = 0;
     server.pidfile = NULL;
     server.logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
+    server.loglevel = CONFIG_LOG_LEVEL;
+    server.log_sample_rate = CONFIG_LOG_SAMPLE_RATE;
+    server.log_verbose = 0;
+    server.log_async = CONFIG_LOG_ASYNC;
+    server.log_ring_size = CONFIG_LOG_RING_SIZE;
+    server.log_full_policy = CONFIG_LOG_FULL_POLICY;
     server.auth_domain = zstrdup(CONFIG_CIVET_AUTH_DOMAIN);
     server.auth_domain_check = zstrdup(CONFIG_CIVET_DOMAIN_CHECK);
     server.ssl = CONFIG_CIVET_SSL_NO;
@@ -638,6 +1038,7 @@ static void initServer() {
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
     setupSignalHandlers();
+    kx_arena_init(server.request_arena_size);
 
     ret = mg_init_library(MG_FEATURES_TLS);
     if (ret != MG_FEATURES_TLS) {
@@ -652,6 +1053,7 @@ static void initServer() {
 
     memset(&server.callbacks, 0, sizeof(struct mg_callbacks));
     server.callbacks.log_message = log_message_cb;
+    server.callbacks.init_connection = init_connection_cb;
     server.callbacks.connection_close = connection_close_cb;
     server.callbacks.http_error = http_error;
     // server.callbacks.init_ssl = init_ssl;
@@ -680,6 +1082,26 @@ static void initServer() {
             log_error("Failed to open or create the %s log file.", server.logfile);
         }
     }
+    log_set_level(server.loglevel);
+    if (server.log_async && log_async_start(server.log_ring_size, server.log_full_policy) != 0)
+        log_error("Failed to start the asynchronous logger, logging synchronously.");
+
+    log_info("Memory allocator: %s", ZMALLOC_LIB);
+    kx_traceid_init(server.node_id);
+    if (server.compression && kx_compress_init(server.compression_level) != 0) {
+        log_warn("Failed to set up response compression, responses are sent as they are");
+        server.compression = 0;
+    }
+    kx_pool_init(server.redis_pool_size);
+    if (server.redis_async && kx_aio_start(server.redis_async_conns) != 0) {
+        log_warn("redis-async unavailable, using blocking redis connections");
+        server.redis_async = 0;
+    }
+    if (server.file_cache_size > 0)
+        server.filecache = kx_cache_create(server.file_cache_size, server.file_cache_ttl);
+    if (redis_load_scripts() != 0)
+        log_warn("Failed to load the redis scripts, they will be loaded on first use");
+    initApiIndex();
 
     return;
 err:
@@ -694,6 +1116,7 @@ static void startServer() {
     if (server.ctx && server.error.code == MG_ERROR_DATA_CODE_OK) {
         mg_set_request_handler(server.ctx, "/", request_handler, NULL);
         mg_set_request_handler(server.ctx, "/api", apidoc_handle_request, NULL);
+        mg_set_request_handler(server.ctx, "/metrics", metrics_handler, NULL);
     } else {
         log_error("Initialization failed, (%u) %s", server.error.code, server.error.text);
         goto err;
@@ -725,6 +1148,9 @@ err:
 static void stopServer() {
     if (server.ctx) 
         mg_stop(server.ctx);
+    kx_aio_stop();
+    kx_pool_free();
+    kx_cache_free(server.filecache);
     if (server.configfile)
         sdsfree(server.configfile);
     if (server.redisip)
@@ -750,6 +1176,7 @@ static void stopServer() {
         zfree(server.ssl_protocol_version);
     if (server.ssl_cipher_list)
         zfree(server.ssl_cipher_list);
+    log_async_stop();
     if (server.logfp)
         fclose(server.logfp);
     
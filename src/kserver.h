@@ -51,14 +51,27 @@
 #include "cJSON.h"
 #include "data.h"
 #include "db.h"
+#include "pool.h"
+#include "redisio.h"
+#include "cache.h"
+#include "metrics.h"
+#include "traceid.h"
+#include "compress.h"
+#include "arena.h"
 #include "util.h"
 #include "log.h"
 
 #define KSERVER_VERSION         "1.0.0"
 #define REDIS_PAGENUM           100
-#define MAXLEN                  1024
+#define TRACE_BATCH_MAX         1000
+#define FILE_BATCH_MAX          1000
+#define STREAM_SCAN_COUNT       1000
 #define HTTP_OK                 200
+#define HTTP_BADREQUEST         400
 #define HTTP_NOFOUND            404
+#define HTTP_NOTALLOWED         405
+#define HTTP_TOOLARGE           413
+#define HTTP_READ_CHUNK         4096
 #define HTTP_ROOT               "./api"
 #define HTTP_PORT               "8099"
 #define HTTP_REQUEST_MS         "10000"
@@ -66,8 +79,31 @@
 #define CONFIG_MAX_LINE         1024
 #define CONFIG_DEFAULT_PID_FILE "/var/run/kserver.pid"
 #define CONFIG_DEFAULT_LOGFILE  ""
+#define CONFIG_LOG_LEVEL        LOG_INFO
+#define CONFIG_LOG_SAMPLE_RATE  1
+#define CONFIG_LOG_ASYNC        0
+#define CONFIG_LOG_RING_SIZE    256
+#define CONFIG_LOG_FULL_POLICY  LOG_FULL_DROP
+#define CONFIG_NODE_ID          0
 #define CONFIG_REDIS_IP         "127.0.0.1"
 #define CONFIG_REDIS_PORT       6379
+#define CONFIG_MAX_REQUEST_SIZE (1024*1024)
+#define CONFIG_COMPRESSION      1
+#define CONFIG_COMPRESSION_MIN_SIZE 1024
+#define CONFIG_COMPRESSION_LEVEL 6
+#define CONFIG_REQUEST_ARENA_SIZE (64*1024)
+#define CONFIG_FILE_CACHE_SIZE  65536
+#define CONFIG_FILE_CACHE_TTL   60
+#define CONFIG_REDIS_POOL_SIZE  50
+#define CONFIG_REDIS_POOL_IDLE  300
+#define CONFIG_REDIS_POOL_CHECK 30
+#define CONFIG_REDIS_POOL_WAIT  1000
+#define CONFIG_REDIS_BACKOFF_MIN 100
+#define CONFIG_REDIS_BACKOFF_MAX 5000
+#define CONFIG_REDIS_PAGE_SCANS 8
+#define CONFIG_REDIS_COMPRESSION 0
+#define CONFIG_REDIS_ASYNC      0
+#define CONFIG_REDIS_ASYNC_CONNS 2
 
 #define CONFIG_CIVET_AUTH_DOMAIN    "localhost"
 #define CONFIG_CIVET_DOMAIN_CHECK   "yes"
@@ -91,16 +127,39 @@ struct Server {
     struct mg_error_data error;
     uint64_t clients;                   /* Current number of connections */
     char *system_info;                  /* information on the system. Useful for support requests.*/
+    int node_id;                        /* Distinguishes the trace ids of kservers sharing a redis */
     /* configure */
     char *redisip;                      /* redis server ip address */
     uint32_t redisport;                 /* redis server port */
-    redisContext *redisctx;
+    int redis_pool_size;                /* Maximum number of pooled redis connections */
+    int redis_pool_idle;                /* Seconds after which an idle pooled connection is
+                                         * closed and reopened, 0 to keep it forever */
+    int redis_pool_check;               /* Seconds of idleness after which a pooled connection
+                                         * is pinged before use, 0 to disable */
+    int redis_pool_wait;                /* Milliseconds to wait for a free pooled connection
+                                         * when all of them are busy */
+    int redis_backoff_min;              /* Milliseconds to wait before retrying redis after
+                                         * the first failed connection attempt */
+    int redis_backoff_max;              /* Upper bound of the doubling reconnect wait */
+    int redis_compression;              /* Store file JSON compressed */
+    int redis_async;                    /* Run redis commands on the async I/O thread */
+    int redis_async_conns;              /* Connections multiplexed by the I/O thread */
+    Kcache *filecache;                  /* /fileget responses by file uuid, NULL if disabled */
+    unsigned long file_cache_size;      /* Maximum number of cached files, 0 disables the cache */
+    int file_cache_ttl;                 /* Seconds a cached file stays valid */
     char *configfile;                   /* Absolute config file path, or NULL */
     uint32_t pagenum;                   /* Redis paging query is the maximum number 
                                          * of query data items per page.*/
+    int page_scans;                     /* HSCAN calls allowed to fill one page */
     const char **options;
     char *httpport;                     /* web service configuration port */
     char *request_timeout;              /* Request timeout in milliseconds */
+    long long max_request_size;         /* Largest accepted request body in bytes */
+    int compression;                    /* Compress responses for clients that accept it */
+    size_t compression_min_size;        /* Smaller responses are sent as they are */
+    int compression_level;              /* zlib level, 1 fastest to 9 smallest */
+    size_t request_arena_size;          /* Block size of the per thread request arena,
+                                         * 0 allocates request memory from the heap */
     char *auth_domain;                  /* config parameter of the domain being configured.*/
     char *auth_domain_check;            /* */
     char *ssl_certificate;              /* configuration parameter to the
@@ -120,13 +179,23 @@ struct Server {
     char *pidfile;                      /* PID file path */
     char *logfile;                      /* log file */
     FILE *logfp;                        /* log file handle */
+    int loglevel;                       /* Configured minimum level logged */
+    unsigned log_sample_rate;           /* Log 1 of N high volume messages */
+    int log_verbose;                    /* Set by SIGUSR1 until SIGUSR2 */
+    int log_async;                      /* Write logs from a background thread */
+    int log_ring_size;                  /* Lines queued per thread in async mode */
+    int log_full_policy;                /* LOG_FULL_DROP or LOG_FULL_BLOCK */
 };
 
 typedef sds (*json_parse_handler)(char *buf, size_t len);
+typedef int (*json_stream_handler)(char *buf, size_t len, Kwriter *w);
 struct ApiEntry {
     char *uri;                  /* HTTP URI */
     char *method;               /* POST / GET */
     json_parse_handler jfunc;   /* json parsing function */
+    json_stream_handler sfunc;  /* Used instead of jfunc for responses
+                                 * streamed with chunked encoding */
+    Kstats stats;               /* Request counters and latencies, see /metrics */
 };
 
 
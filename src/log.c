@@ -21,8 +21,17 @@
  */
 
 #include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #define MAX_CALLBACKS 32
+#define LOG_RECORD_SIZE 512   /* Longer async records are truncated */
+#define LOG_BATCH_MAX 256     /* Records written by a single writev */
 
 typedef struct {
   log_LogFn fn;
@@ -30,10 +39,13 @@ typedef struct {
   int level;
 } Callback;
 
+/* Records below this level are dropped by every sink. The log_* macros
+ * test it before evaluating their arguments. */
+int log_current_level = LOG_TRACE;
+
 static struct {
   void *udata;
   log_LockFn lock;
-  int level;
   bool quiet;
   Callback callbacks[MAX_CALLBACKS];
 } L;
@@ -117,7 +129,20 @@ void log_set_lock(log_LockFn fn, void *udata) {
 
 
 void log_set_level(int level) {
-  L.level = level;
+  __atomic_store_n(&log_current_level, level, __ATOMIC_RELAXED);
+}
+
+
+int log_get_level(void) {
+  return __atomic_load_n(&log_current_level, __ATOMIC_RELAXED);
+}
+
+
+int log_level_from_string(const char *s) {
+  for (int i = LOG_TRACE; i <= LOG_FATAL; i++) {
+    if (!strcasecmp(s, level_strings[i])) { return i; }
+  }
+  return -1;
 }
 
 
@@ -152,6 +177,300 @@ static void init_event(log_Event *ev, void *udata) {
 }
 
 
+/*
+ * Asynchronous mode.
+ *
+ * Every thread formats its records into a ring buffer of its own, a
+ * single producer / single consumer queue, so logging takes no lock and
+ * makes no system call. A writer thread drains all rings and writes the
+ * records to stderr and to the log files with one writev per sink and
+ * batch. Timestamps are formatted at most once per second and thread.
+ * When a ring is full the record is dropped (and counted), or with
+ * LOG_FULL_BLOCK the thread waits for the writer to catch up.
+ *
+ * Only the sinks added with log_add_fp and stderr are asynchronous,
+ * other callbacks are still called synchronously by log_log.
+ */
+
+typedef struct {
+  int level;
+  int len;
+  char buf[LOG_RECORD_SIZE];
+} log_Record;
+
+typedef struct log_Ring {
+  log_Record *records;
+  unsigned mask;
+  unsigned head;          /* Next slot filled by the owner thread */
+  unsigned tail;          /* Next slot written out by the writer */
+  unsigned next_tail;     /* tail once the current batch is written */
+  int dead;               /* The owner thread exited */
+  struct log_Ring *next;
+} log_Ring;
+
+static struct {
+  int running;
+  int stop;
+  int policy;
+  unsigned size;          /* Records per ring, a power of two */
+  pthread_t thread;
+  pthread_key_t key;
+  pthread_mutex_t mutex;  /* Protects the ring list */
+  log_Ring *rings;
+  unsigned long long dropped;
+} A = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread log_Ring *thread_ring = NULL;
+static __thread time_t cached_sec = -1;
+static __thread char cached_time[32];
+
+
+static const char *log_timestamp(void) {
+  time_t t = time(NULL);
+  if (t != cached_sec) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    cached_time[strftime(cached_time, sizeof(cached_time), "%Y-%m-%d %H:%M:%S", &tm)] = '\0';
+    cached_sec = t;
+  }
+  return cached_time;
+}
+
+
+static void ring_release(void *ptr) {
+  log_Ring *r = ptr;
+  __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+
+static log_Ring *ring_get(void) {
+  log_Ring *r = thread_ring;
+  if (r) { return r; }
+
+  r = calloc(1, sizeof(log_Ring));
+  if (!r) { return NULL; }
+  r->records = malloc(sizeof(log_Record) * A.size);
+  if (!r->records) {
+    free(r);
+    return NULL;
+  }
+  r->mask = A.size - 1;
+
+  pthread_mutex_lock(&A.mutex);
+  r->next = A.rings;
+  A.rings = r;
+  pthread_mutex_unlock(&A.mutex);
+  pthread_setspecific(A.key, r);
+  thread_ring = r;
+  return r;
+}
+
+
+static void async_log(int level, const char *file, int line, const char *fmt, va_list ap) {
+  log_Ring *r = ring_get();
+  log_Record *rec;
+  unsigned head;
+  int n;
+
+  if (!r) { return; }
+  head = r->head;
+  while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask) {
+    struct timespec ts = { 0, 100000 };
+    if (A.policy == LOG_FULL_DROP || !__atomic_load_n(&A.running, __ATOMIC_ACQUIRE)) {
+      __atomic_add_fetch(&A.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    nanosleep(&ts, NULL);
+  }
+
+  rec = &r->records[head & r->mask];
+  n = snprintf(rec->buf, LOG_RECORD_SIZE, "%s %-5s %s:%d: ",
+               log_timestamp(), level_strings[level], file, line);
+  if (n >= 0 && n < LOG_RECORD_SIZE - 1) {
+    int m = vsnprintf(rec->buf + n, LOG_RECORD_SIZE - n, fmt, ap);
+    if (m > 0) { n += m; }
+  }
+  if (n < 0) { n = 0; }
+  if (n > LOG_RECORD_SIZE - 1) { n = LOG_RECORD_SIZE - 1; }
+  rec->buf[n++] = '\n';
+  rec->len = n;
+  rec->level = level;
+
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static void writev_all(int fd, struct iovec *iov, int cnt) {
+  while (cnt > 0) {
+    ssize_t n = writev(fd, iov, cnt);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      return;
+    }
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+
+/* Write the records of a batch whose level is at least 'level' to fd. */
+static void sink_write(FILE *fp, int level, struct iovec *batch, int *levels, int cnt) {
+  struct iovec iov[LOG_BATCH_MAX];
+  int n = 0;
+  for (int i = 0; i < cnt; i++) {
+    if (levels[i] >= level) { iov[n++] = batch[i]; }
+  }
+  if (n) { writev_all(fileno(fp), iov, n); }
+}
+
+
+static void sinks_write(struct iovec *batch, int *levels, int cnt) {
+  if (!L.quiet) {
+    sink_write(stderr, LOG_TRACE, batch, levels, cnt);
+  }
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    Callback *cb = &L.callbacks[i];
+    if (cb->fn == file_callback) {
+      sink_write(cb->udata, cb->level, batch, levels, cnt);
+    }
+  }
+}
+
+
+/* Write out one batch of records taken from every ring. Returns the
+ * number of records written. */
+static int async_drain(void) {
+  struct iovec batch[LOG_BATCH_MAX];
+  int levels[LOG_BATCH_MAX];
+  log_Ring *r, *first, **prev;
+  int cnt = 0;
+
+  /* Rings are only added at the head of the list and only removed by
+   * this thread, the list can be walked without the lock. */
+  pthread_mutex_lock(&A.mutex);
+  first = A.rings;
+  pthread_mutex_unlock(&A.mutex);
+
+  for (r = first; r; r = r->next) {
+    unsigned tail = r->tail;
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (tail != head && cnt < LOG_BATCH_MAX) {
+      log_Record *rec = &r->records[tail & r->mask];
+      batch[cnt].iov_base = rec->buf;
+      batch[cnt].iov_len = rec->len;
+      levels[cnt] = rec->level;
+      cnt++;
+      tail++;
+    }
+    r->next_tail = tail;
+  }
+
+  if (cnt) { sinks_write(batch, levels, cnt); }
+
+  pthread_mutex_lock(&A.mutex);
+  /* Skip the rings added since the walk above */
+  prev = &A.rings;
+  while ((r = *prev) && r != first) { prev = &r->next; }
+  while ((r = *prev)) {
+    __atomic_store_n(&r->tail, r->next_tail, __ATOMIC_RELEASE);
+    /* The owner is gone and everything it logged is written */
+    if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE)
+        && r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+      *prev = r->next;
+      free(r->records);
+      free(r);
+      continue;
+    }
+    prev = &r->next;
+  }
+  pthread_mutex_unlock(&A.mutex);
+  return cnt;
+}
+
+
+static void *async_writer(void *arg) {
+  unsigned long long reported = 0;
+  (void)arg;
+
+  for (;;) {
+    int stop = __atomic_load_n(&A.stop, __ATOMIC_ACQUIRE);
+    unsigned long long dropped = __atomic_load_n(&A.dropped, __ATOMIC_RELAXED);
+
+    if (dropped != reported) {
+      char msg[128];
+      struct iovec iov;
+      int level = LOG_WARN;
+      iov.iov_base = msg;
+      iov.iov_len = snprintf(msg, sizeof(msg), "%s %-5s %llu log records dropped, log ring full\n",
+                             log_timestamp(), level_strings[level], dropped - reported);
+      sinks_write(&iov, &level, 1);
+      reported = dropped;
+    }
+
+    if (async_drain() == 0) {
+      struct timespec ts = { 0, 2000000 };
+      if (stop) { break; }
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+
+/* Switch to asynchronous logging. 'size' is the number of records of
+ * every thread ring, rounded up to a power of two. */
+int log_async_start(unsigned size, int policy) {
+  unsigned n = 2;
+  if (A.running) { return 0; }
+  while (n < size) { n <<= 1; }
+
+  A.size = n;
+  A.policy = policy;
+  A.stop = 0;
+  if (pthread_key_create(&A.key, ring_release) != 0) { return -1; }
+
+  /* Records written so far through stdio go out first */
+  fflush(stderr);
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (L.callbacks[i].fn == file_callback) { fflush(L.callbacks[i].udata); }
+  }
+
+  if (pthread_create(&A.thread, NULL, async_writer, NULL) != 0) {
+    pthread_key_delete(A.key);
+    return -1;
+  }
+  __atomic_store_n(&A.running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+/* Write out every pending record and go back to synchronous logging. */
+void log_async_stop(void) {
+  log_Ring *r, *next;
+  if (!A.running) { return; }
+
+  __atomic_store_n(&A.running, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&A.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(A.thread, NULL);
+  pthread_key_delete(A.key);
+
+  for (r = A.rings; r; r = next) {
+    next = r->next;
+    free(r->records);
+    free(r);
+  }
+  A.rings = NULL;
+  thread_ring = NULL;
+}
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
   log_Event ev = {
     .fmt   = fmt,
@@ -160,9 +479,29 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     .level = level,
   };
 
+  if (!log_enabled(level)) { return; }
+
+  if (__atomic_load_n(&A.running, __ATOMIC_ACQUIRE)) {
+    va_start(ev.ap, fmt);
+    async_log(level, file, line, fmt, ev.ap);
+    va_end(ev.ap);
+    lock();
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+      Callback *cb = &L.callbacks[i];
+      if (cb->fn != file_callback && level >= cb->level) {
+        init_event(&ev, cb->udata);
+        va_start(ev.ap, fmt);
+        cb->fn(&ev);
+        va_end(ev.ap);
+      }
+    }
+    unlock();
+    return;
+  }
+
   lock();
 
-  if (!L.quiet && level >= L.level) {
+  if (!L.quiet) {
     init_event(&ev, stderr);
     va_start(ev.ap, fmt);
     stdout_callback(&ev);
@@ -31,28 +31,66 @@ typedef void (*log_LockFn)(bool lock, void *udata);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
+/* What an asynchronous logging thread does when its ring is full */
+enum { LOG_FULL_DROP, LOG_FULL_BLOCK };
+
+extern int log_current_level;
+
+/* True if records of this level are written anywhere. */
+#define log_enabled(level) ((level) >= __atomic_load_n(&log_current_level, __ATOMIC_RELAXED))
+
+/* The level is checked before the call, disabled logs do not even
+ * evaluate their arguments.
+ *
+ * log_sampled is meant for high volume call sites: only one of every
+ * 'rate' calls of this very call site is logged, rate 0 or 1 logs
+ * every call. */
 #if __STDC_VERSION__ >= 199901L
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+#define log_at(level, ...) do { \
+    if (log_enabled(level)) log_log(level, __FILE__, __LINE__, __VA_ARGS__); \
+  } while (0)
+#define log_sampled(level, rate, ...) do { \
+    static unsigned log_sample_count_; \
+    unsigned log_sample_rate_ = (rate); \
+    if (log_enabled(level) && (log_sample_rate_ <= 1 || \
+        __atomic_fetch_add(&log_sample_count_, 1, __ATOMIC_RELAXED) % log_sample_rate_ == 0)) \
+      log_log(level, __FILE__, __LINE__, __VA_ARGS__); \
+  } while (0)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO,  __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN,  __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_fatal(...) log_at(LOG_FATAL, __VA_ARGS__)
 #else
-#define log_trace(args...) log_log(LOG_TRACE, __FILE__, __LINE__, args)
-#define log_debug(args...) log_log(LOG_DEBUG, __FILE__, __LINE__, args)
-#define log_info(args...)  log_log(LOG_INFO,  __FILE__, __LINE__, args)
-#define log_warn(args...)  log_log(LOG_WARN,  __FILE__, __LINE__, args)
-#define log_error(args...) log_log(LOG_ERROR, __FILE__, __LINE__, args)
-#define log_fatal(args...) log_log(LOG_FATAL, __FILE__, __LINE__, args)
+#define log_at(level, args...) do { \
+    if (log_enabled(level)) log_log(level, __FILE__, __LINE__, args); \
+  } while (0)
+#define log_sampled(level, rate, args...) do { \
+    static unsigned log_sample_count_; \
+    unsigned log_sample_rate_ = (rate); \
+    if (log_enabled(level) && (log_sample_rate_ <= 1 || \
+        __atomic_fetch_add(&log_sample_count_, 1, __ATOMIC_RELAXED) % log_sample_rate_ == 0)) \
+      log_log(level, __FILE__, __LINE__, args); \
+  } while (0)
+#define log_trace(args...) log_at(LOG_TRACE, args)
+#define log_debug(args...) log_at(LOG_DEBUG, args)
+#define log_info(args...)  log_at(LOG_INFO,  args)
+#define log_warn(args...)  log_at(LOG_WARN,  args)
+#define log_error(args...) log_at(LOG_ERROR, args)
+#define log_fatal(args...) log_at(LOG_FATAL, args)
 #endif
 
 const char* log_level_string(int level);
 void log_set_lock(log_LockFn fn, void *udata);
 void log_set_level(int level);
+int log_get_level(void);
+int log_level_from_string(const char *s);
 void log_set_quiet(bool enable);
 int log_add_callback(log_LogFn fn, void *udata, int level);
 int log_add_fp(FILE *fp, int level);
+int log_async_start(unsigned size, int policy);
+void log_async_stop(void);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stddef.h>
+#include "kserver.h"
+#include "atomicvar.h"
+
+/* Redis time of the request being served by this thread */
+static __thread long long redis_us = 0;
+
+static const char *phase_names[PHASE_NUM] = {
+    "parse", "redis", "serialize", "write", "total"
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define QUANTILES_NUM (sizeof(quantiles) / sizeof(quantiles[0]))
+
+long long kx_metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void kx_metrics_redis_add(long long us) {
+    redis_us += us;
+}
+
+long long kx_metrics_redis_take(void) {
+    long long us = redis_us;
+
+    redis_us = 0;
+    return us;
+}
+
+/* Bucket of a value: values below METRICS_SUB_BUCKETS have their own
+ * bucket, above that the three bits following the most significant one
+ * select the sub bucket of its power of two. */
+static int kx_hist_index(uint64_t v) {
+    int msb, shift, idx;
+
+    if (v < METRICS_SUB_BUCKETS)
+        return (int)v;
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - METRICS_SUB_BITS;
+    idx = (shift + 1) * METRICS_SUB_BUCKETS + (int)((v >> shift) - METRICS_SUB_BUCKETS);
+    return idx < METRICS_BUCKETS ? idx : METRICS_BUCKETS - 1;
+}
+
+/* Highest value that falls in a bucket */
+static uint64_t kx_hist_value(int idx) {
+    int shift;
+    uint64_t sub;
+
+    if (idx < METRICS_SUB_BUCKETS)
+        return idx;
+    shift = idx / METRICS_SUB_BUCKETS - 1;
+    sub = idx % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void kx_hist_record(Khist *h, long long us) {
+    /* The monotonic clock never goes back, but stay safe. */
+    if (us < 0)
+        us = 0;
+    atomicIncr(h->buckets[kx_hist_index(us)], 1);
+    atomicIncr(h->count, 1);
+    atomicIncr(h->sum, us);
+}
+
+void kx_metrics_record(Kstats *st, const Ksample *sample) {
+    atomicIncr(st->requests, 1);
+    if (sample->error)
+        atomicIncr(st->errors, 1);
+    atomicIncr(st->bytes_in, sample->bytes_in);
+    atomicIncr(st->bytes_out, sample->bytes_out);
+    for (int i = 0; i < PHASE_NUM; i++)
+        kx_hist_record(&st->phases[i], sample->phase[i]);
+}
+
+/* Append the quantiles, sum and count of a histogram as a summary. The
+ * buckets are read one by one while other threads keep recording, so
+ * the total is taken from the copied buckets to stay consistent. */
+static sds kx_hist_cat(sds s, const char *name, const char *phase, Khist *h) {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t total = 0, sum, seen;
+    int idx;
+
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        atomicGet(h->buckets[i], buckets[i]);
+        total += buckets[i];
+    }
+    atomicGet(h->sum, sum);
+
+    for (size_t q = 0; q < QUANTILES_NUM; q++) {
+        uint64_t rank = (uint64_t)(quantiles[q] * total + 0.999999);
+        double value = 0;
+
+        if (total) {
+            if (rank == 0) rank = 1;
+            for (idx = 0, seen = 0; idx < METRICS_BUCKETS; idx++) {
+                seen += buckets[idx];
+                if (seen >= rank)
+                    break;
+            }
+            value = kx_hist_value(idx < METRICS_BUCKETS ? idx : METRICS_BUCKETS - 1) / 1e6;
+        }
+        s = sdscatprintf(s,
+            "kserver_request_duration_seconds{endpoint=\"%s\",phase=\"%s\",quantile=\"%g\"} %.6f\n",
+            name, phase, quantiles[q], value);
+    }
+    s = sdscatprintf(s, "kserver_request_duration_seconds_sum{endpoint=\"%s\",phase=\"%s\"} %.6f\n",
+                     name, phase, sum / 1e6);
+    s = sdscatprintf(s, "kserver_request_duration_seconds_count{endpoint=\"%s\",phase=\"%s\"} %" PRIu64 "\n",
+                     name, phase, total);
+    return s;
+}
+
+static sds kx_counter_cat(sds s, const char *metric, const char *help,
+                          int n, const char **names, Kstats **stats, size_t offset) {
+    s = sdscatprintf(s, "# HELP %s %s\n# TYPE %s counter\n", metric, help, metric);
+    for (int i = 0; i < n; i++) {
+        uint64_t *field = (uint64_t *)((char *)stats[i] + offset);
+        uint64_t v;
+
+        atomicGet(*field, v);
+        s = sdscatprintf(s, "%s{endpoint=\"%s\"} %" PRIu64 "\n", metric, names[i], v);
+    }
+    return s;
+}
+
+sds kx_metrics_cat(sds s, int n, const char **names, Kstats **stats) {
+    s = kx_counter_cat(s, "kserver_requests_total", "Requests served.",
+                       n, names, stats, offsetof(Kstats, requests));
+    s = kx_counter_cat(s, "kserver_request_errors_total", "Requests answered with an error.",
+                       n, names, stats, offsetof(Kstats, errors));
+    s = kx_counter_cat(s, "kserver_received_bytes_total", "Request body bytes received.",
+                       n, names, stats, offsetof(Kstats, bytes_in));
+    s = kx_counter_cat(s, "kserver_sent_bytes_total", "Response body bytes sent.",
+                       n, names, stats, offsetof(Kstats, bytes_out));
+
+    s = sdscat(s, "# HELP kserver_request_duration_seconds Request latency by phase.\n"
+                  "# TYPE kserver_request_duration_seconds summary\n");
+    for (int i = 0; i < n; i++) {
+        for (int p = 0; p < PHASE_NUM; p++)
+            s = kx_hist_cat(s, names[i], phase_names[p], &stats[i]->phases[p]);
+    }
+    return s;
+}
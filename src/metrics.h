@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <stdint.h>
+
+/* Request latencies are recorded in HDR style histograms: values are
+ * bucketed by power of two, and every power of two is split linearly in
+ * METRICS_SUB_BUCKETS, so any recorded value is known within 12.5%
+ * whatever its magnitude. Values are in microseconds, the last bucket
+ * collects everything above ~18 minutes. */
+#define METRICS_SUB_BITS    3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS     (28 * METRICS_SUB_BUCKETS)
+
+/* Phases a request is timed in */
+typedef enum Kphase {
+    PHASE_PARSE,        /* Reading the request body */
+    PHASE_REDIS,        /* Waiting for redis */
+    PHASE_SERIALIZE,    /* JSON decoding and encoding around the redis calls */
+    PHASE_WRITE,        /* Sending the response */
+    PHASE_TOTAL,        /* The whole request */
+    PHASE_NUM
+} Kphase;
+
+typedef struct Khist {
+    uint64_t count;
+    uint64_t sum;                       /* Microseconds */
+    uint64_t buckets[METRICS_BUCKETS];
+} Khist;
+
+/* Counters of one endpoint. Every field is updated with relaxed atomic
+ * adds, recording a request takes no lock. */
+typedef struct Kstats {
+    uint64_t requests;
+    uint64_t errors;            /* HTTP errors and FAIL/ERROR answers */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    Khist phases[PHASE_NUM];
+} Kstats;
+
+/* Measurements of a single request */
+typedef struct Ksample {
+    long long phase[PHASE_NUM]; /* Microseconds spent in every phase */
+    size_t bytes_in;
+    size_t bytes_out;
+    int error;
+} Ksample;
+
+/** @brief Monotonic clock used to time requests
+ * 
+ * @return Microseconds since an arbitrary point in the past
+ */
+long long kx_metrics_now(void);
+
+/** @brief Account time spent waiting for redis to the request being
+ *         served by the calling thread.
+ * 
+ * @param us Microseconds
+ */
+void kx_metrics_redis_add(long long us);
+
+/** @brief Return the redis time accounted by the calling thread since
+ *         the previous call, and reset it.
+ * 
+ * @return Microseconds
+ */
+long long kx_metrics_redis_take(void);
+
+/** @brief Add a request to the statistics of its endpoint
+ * 
+ * @param st Endpoint statistics
+ * @param sample Measurements of the request
+ */
+void kx_metrics_record(Kstats *st, const Ksample *sample);
+
+/** @brief Append the statistics of every endpoint to s in the
+ *         Prometheus text exposition format.
+ * 
+ * @param s Output string
+ * @param n Number of endpoints
+ * @param names Endpoint names, used as the 'endpoint' label
+ * @param stats Statistics of every endpoint
+ * @return The output string
+ */
+sds kx_metrics_cat(sds s, int n, const char **names, Kstats **stats);
+
+#endif
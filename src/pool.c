@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "kserver.h"
+#include "atomicvar.h"
+
+#define REDIS_CLI_KEEPALIVE_INTERVAL 15 /* seconds */
+
+static Kpool pool;
+
+/* Slot at which the calling thread starts looking for a free connection,
+ * -1 until the thread checks out its first connection. */
+static __thread int pool_hint = -1;
+
+/* Circuit breaker guarding the connection attempts to redis.
+ *
+ * CLOSED     redis is healthy, connections are opened on demand.
+ * OPEN       the last connection attempt failed. Until retry_at every
+ *            request needing a new connection fails immediately instead
+ *            of waiting for the connect timeout.
+ * HALF_OPEN  retry_at has passed and a single thread is probing redis.
+ *            The others keep failing fast until the probe succeeds
+ *            (back to CLOSED) or fails (back to OPEN with a longer wait).
+ *
+ * The wait doubles on every consecutive failure between redis-backoff-min
+ * and redis-backoff-max milliseconds, with random jitter so that several
+ * kserver instances do not hammer a recovering redis in lockstep. */
+static struct {
+    int state;
+    int failures;           /* Consecutive failed connection attempts */
+    long long retry_at;     /* Unix time in microseconds of the next probe */
+} breaker;
+
+static __thread unsigned int breaker_seed = 0;
+
+long long kx_breaker_backoff(int failures) {
+    long long wait = server.redis_backoff_min;
+
+    while (--failures > 0 && wait < server.redis_backoff_max)
+        wait *= 2;
+    if (wait > server.redis_backoff_max)
+        wait = server.redis_backoff_max;
+
+    if (breaker_seed == 0)
+        breaker_seed = (unsigned int)(ustime() ^ (long long)pthread_self());
+    /* Equal jitter: somewhere between half and all of the wait. */
+    wait = wait / 2 + rand_r(&breaker_seed) % (wait / 2 + 1);
+    return wait * 1000;
+}
+
+/* Returns 1 if the caller may try to connect, 0 if it must fail fast.
+ * A caller that is allowed in while the breaker is not CLOSED is the
+ * probe and must report the outcome with kx_breaker_result. */
+static int kx_breaker_allow(void) {
+    int state = __atomic_load_n(&breaker.state, __ATOMIC_ACQUIRE);
+
+    if (state == BREAKER_CLOSED)
+        return 1;
+    if (state == BREAKER_OPEN
+        && ustime() >= __atomic_load_n(&breaker.retry_at, __ATOMIC_ACQUIRE)) {
+        /* Only the thread winning the swap probes redis. */
+        return __atomic_compare_exchange_n(&breaker.state, &state, BREAKER_HALF_OPEN,
+                                           0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void kx_breaker_result(int ok) {
+    if (ok) {
+        if (__atomic_exchange_n(&breaker.state, BREAKER_CLOSED, __ATOMIC_ACQ_REL) != BREAKER_CLOSED)
+            log_info("redis %s:%d reachable again, circuit closed", server.redisip, server.redisport);
+        __atomic_store_n(&breaker.failures, 0, __ATOMIC_RELEASE);
+    } else {
+        int failures = __atomic_add_fetch(&breaker.failures, 1, __ATOMIC_ACQ_REL);
+        long long wait = kx_breaker_backoff(failures);
+
+        __atomic_store_n(&breaker.retry_at, ustime() + wait, __ATOMIC_RELEASE);
+        if (__atomic_exchange_n(&breaker.state, BREAKER_OPEN, __ATOMIC_ACQ_REL) != BREAKER_OPEN)
+            log_warn("redis %s:%d unreachable (%d failures), circuit open, next attempt in %lld ms",
+                     server.redisip, server.redisport, failures, wait / 1000);
+    }
+}
+
+/* Create a redis link context. Returns NULL without blocking while the
+ * circuit breaker is open, or if the connection attempt fails. */
+static redisContext *create_redis_ctx() {
+    redisContext *ctx = NULL;
+    struct timeval timeout = {1, 500000}; // 1.5 seconds
+
+    if (!kx_breaker_allow())
+        return NULL;
+
+    ctx = redisConnectWithTimeout(server.redisip, server.redisport, timeout);
+    if (ctx == NULL || ctx->err) {
+        if (ctx) {
+            log_error("redis failed connect (%s)", ctx->errstr);
+            redisFree(ctx);
+            ctx = NULL;
+        } else {
+            log_error("redis Connection error: can't allocate redis context");
+        }
+        kx_breaker_result(0);
+        return NULL;
+    }
+    kx_breaker_result(1);
+
+    /* Set aggressive KEEP_ALIVE socket option in the Redis context socket
+    * in order to prevent timeouts caused by the execution of long
+    * commands. At the same time this improves the detection of real
+    * errors. */
+    redisKeepAlive(ctx, REDIS_CLI_KEEPALIVE_INTERVAL);
+
+    return ctx;
+}
+
+/* Send a PING on an idle connection, returns 0 if redis answered. */
+static int kx_pool_ping(redisContext *ctx) {
+    int ret = -1;
+    redisReply *reply;
+
+    reply = redisCommand(ctx, "PING");
+    if (reply) {
+        if (reply->type == REDIS_REPLY_STATUS)
+            ret = 0;
+        freeReplyObject(reply);
+    }
+    return ret;
+}
+
+/* Make sure the connection of a freshly checked out slot is usable:
+ * connections idle for longer than redis-pool-idle-timeout are dropped,
+ * and connections not verified for redis-pool-health-check seconds are
+ * pinged first. Returns 0 if conn->ctx is ready for use. */
+static int kx_pool_prepare(Kconn *conn) {
+    long long now = ustime() / 1000000;
+
+    if (conn->ctx && server.redis_pool_idle > 0
+        && now - conn->lastused > server.redis_pool_idle) {
+        redisFree(conn->ctx);
+        conn->ctx = NULL;
+    }
+
+    if (conn->ctx && server.redis_pool_check > 0
+        && now - conn->lastcheck > server.redis_pool_check) {
+        if (kx_pool_ping(conn->ctx) != 0) {
+            log_warn("redis pooled connection failed health check, reconnecting");
+            redisFree(conn->ctx);
+            conn->ctx = NULL;
+        }
+        conn->lastcheck = now;
+    }
+
+    if (conn->ctx == NULL) {
+        conn->ctx = create_redis_ctx();
+        conn->lastcheck = now;
+    }
+    return conn->ctx ? 0 : -1;
+}
+
+void kx_pool_init(int size) {
+    pthread_condattr_t attr;
+
+    if (size <= 0)
+        size = 1;
+    pool.conns = zcalloc(sizeof(Kconn) * size);
+    pool.size = size;
+    pool.next = 0;
+    pool.waiters = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool.freed, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void kx_pool_free(void) {
+    for (int i = 0; i < pool.size; i++) {
+        if (pool.conns[i].ctx)
+            redisFree(pool.conns[i].ctx);
+    }
+    zfree(pool.conns);
+    pool.conns = NULL;
+    pool.size = 0;
+    pthread_cond_destroy(&pool.freed);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+/* Claim the first free slot starting at our own one. The busy flag
+ * is taken with a compare-and-swap, no lock is involved. */
+static Kconn *kx_pool_claim(void) {
+    for (int i = 0; i < pool.size; i++) {
+        Kconn *c = &pool.conns[(pool_hint + i) % pool.size];
+        int expected = 0;
+
+        if (__atomic_compare_exchange_n(&c->busy, &expected, 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return c;
+    }
+    return NULL;
+}
+
+/* Every slot is busy: wait for a checkin until redis-pool-wait has
+ * passed. Waiters register before looking again, and checkin wakes
+ * them under the lock, so a slot freed meanwhile is never missed. */
+static Kconn *kx_pool_wait(void) {
+    struct timespec deadline;
+    Kconn *conn;
+    int rc = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += server.redis_pool_wait / 1000;
+    deadline.tv_nsec += (long)(server.redis_pool_wait % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    __atomic_add_fetch(&pool.waiters, 1, __ATOMIC_SEQ_CST);
+    while ((conn = kx_pool_claim()) == NULL && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&pool.freed, &pool.lock, &deadline);
+    __atomic_sub_fetch(&pool.waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool.lock);
+    return conn;
+}
+
+Kconn *kx_pool_checkout(void) {
+    Kconn *conn;
+
+    if (pool_hint == -1) {
+        int n;
+        atomicGetIncr(pool.next, n, 1);
+        pool_hint = n % pool.size;
+    }
+
+    if ((conn = kx_pool_claim()) == NULL && (conn = kx_pool_wait()) == NULL) {
+        log_warn("no free redis connection after %d ms, redis-pool-size %d is too small",
+                 server.redis_pool_wait, pool.size);
+        errno = EBUSY;
+        return NULL;
+    }
+
+    if (kx_pool_prepare(conn) != 0) {
+        kx_pool_checkin(conn);
+        errno = ENOTCONN;
+        return NULL;
+    }
+    return conn;
+}
+
+void kx_pool_checkin(Kconn *conn) {
+    if (conn == NULL)
+        return;
+
+    /* A context that saw an I/O or protocol error can not be reused. */
+    if (conn->ctx && conn->ctx->err) {
+        redisFree(conn->ctx);
+        conn->ctx = NULL;
+    }
+    /* A successful call proves the connection alive as well as a PING. */
+    conn->lastused = conn->lastcheck = ustime() / 1000000;
+    __atomic_store_n(&conn->busy, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool.waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_signal(&pool.freed);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
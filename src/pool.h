@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __POOL__
+#define __POOL__
+
+/* States of the circuit breaker guarding redis connection attempts */
+#define BREAKER_CLOSED      0   /* redis healthy, connect on demand */
+#define BREAKER_OPEN        1   /* redis down, fail fast until the next probe */
+#define BREAKER_HALF_OPEN   2   /* one probe connection in progress */
+
+/* A long-lived redis connection owned by the pool. A worker checks it
+ * out for the duration of one API call and checks it back in afterwards,
+ * so the TCP connection is reused across requests instead of paying a
+ * connect/close for every redis command. */
+typedef struct Kconn {
+    redisContext *ctx;      /* NULL until first used or after an error */
+    int busy;               /* 1 while checked out by a worker */
+    long long lastused;     /* Unix time in seconds of the last checkin */
+    long long lastcheck;    /* Unix time in seconds of the last health check */
+} Kconn;
+
+typedef struct Kpool {
+    Kconn *conns;           /* Fixed array of pooled connections */
+    int size;               /* Number of slots in conns */
+    int next;               /* Slot hint handed to the next new thread */
+    int waiters;            /* Threads waiting for a slot to be checked in */
+    pthread_mutex_t lock;   /* Only taken by waiters and to wake them up */
+    pthread_cond_t freed;
+} Kpool;
+
+/** @brief Create the connection pool. Connections are opened lazily
+ *         on first checkout, so redis need not be up at startup.
+ * 
+ * @param size Maximum number of pooled connections
+ */
+void kx_pool_init(int size);
+
+/** @brief Close every pooled connection and release the pool. */
+void kx_pool_free(void);
+
+/** @brief Check out a connection. Every thread starts its search at
+ *         its own slot, so with a pool at least as large as the civetweb
+ *         thread count workers never contend for the same connection.
+ *         If every slot is busy, wait up to redis-pool-wait milliseconds
+ *         for one to be checked in: the number of redis connections
+ *         never exceeds redis-pool-size.
+ * 
+ * @return The connection, or NULL if redis cannot be reached. While
+ *         redis is down NULL is returned immediately, see the circuit
+ *         breaker in pool.c. errno is then ENOTCONN, or EBUSY if no
+ *         slot was freed in time.
+ */
+Kconn *kx_pool_checkout(void);
+
+/** @brief Return a connection obtained with kx_pool_checkout.
+ *         Connections in an error state are closed and will be
+ *         reopened on the next checkout.
+ * 
+ * @param conn Connection to return
+ */
+void kx_pool_checkin(Kconn *conn);
+
+/** @brief Time to wait before the next connection attempt after the
+ *         given number of consecutive failures: doubling from
+ *         redis-backoff-min up to redis-backoff-max, with jitter.
+ * 
+ * @param failures Consecutive failed attempts, at least 1
+ * @return The wait in microseconds
+ */
+long long kx_breaker_backoff(int failures);
+
+#endif
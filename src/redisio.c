@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "kserver.h"
+
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#endif
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <semaphore.h>
+#include <async.h>
+
+#define AIO_MAX_EVENTS              64
+#define AIO_KEEPALIVE_INTERVAL      15      /* seconds */
+#define AIO_COMMAND_TIMEOUT         5       /* seconds */
+
+#define UNUSED(x) ((void)(x))
+
+/* A redis connection driven by the I/O thread. The slots are allocated
+ * once, so epoll events can point at them even across reconnects. */
+typedef struct Kaioconn {
+    redisAsyncContext *ac;  /* NULL while disconnected */
+    int connected;          /* Set once the connect callback reported success */
+    int fd;
+    int mask;               /* EPOLLIN/EPOLLOUT registered for fd */
+    int failures;           /* Consecutive failed connection attempts */
+    long long retry_at;     /* Unix time in ms of the next connection attempt */
+    long long timer_at;     /* Unix time in ms at which hiredis wants its
+                             * timeout handler called, 0 if not armed */
+} Kaioconn;
+
+/* A batch of commands submitted by a worker. It lives on the stack of
+ * the worker, which sleeps on 'done' until every reply is in. */
+typedef struct Kaiojob {
+    char **cmds;
+    size_t *lens;
+    int ncmds;
+    redisReply **replies;
+    int nreplies;           /* Replies received so far */
+    int pending;            /* Replies still expected */
+    int failed;
+    sem_t done;
+    struct Kaiojob *next;
+} Kaiojob;
+
+static struct {
+    pthread_t thread;
+    int running;            /* Jobs are accepted */
+    int stop;               /* Ask the I/O thread to exit */
+    int epfd;
+    int wakefd;             /* eventfd waking the I/O thread up on new jobs */
+    Kaioconn *conns;
+    int nconns;
+    int next;               /* Round robin position in conns */
+    pthread_mutex_t lock;   /* Protects the job queue, running and stop */
+    Kaiojob *head, *tail;
+} aio = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static long long mstime(void) {
+    return ustime() / 1000;
+}
+
+/*-----------------------------------------------------------------------------
+ * hiredis event library adapter on top of epoll
+ *----------------------------------------------------------------------------*/
+
+static void kx_aio_update(Kaioconn *conn, int mask) {
+    struct epoll_event ee = {0};
+    int op;
+
+    if (mask == conn->mask)
+        return;
+    if (conn->mask == 0)
+        op = EPOLL_CTL_ADD;
+    else if (mask == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    ee.events = mask;
+    ee.data.ptr = conn;
+    if (epoll_ctl(aio.epfd, op, conn->fd, &ee) == -1)
+        log_error("redis async epoll_ctl failed: %s", strerror(errno));
+    conn->mask = mask;
+}
+
+static void kx_aio_add_read(void *privdata) {
+    Kaioconn *conn = privdata;
+    kx_aio_update(conn, conn->mask | EPOLLIN);
+}
+
+static void kx_aio_del_read(void *privdata) {
+    Kaioconn *conn = privdata;
+    kx_aio_update(conn, conn->mask & ~EPOLLIN);
+}
+
+static void kx_aio_add_write(void *privdata) {
+    Kaioconn *conn = privdata;
+    kx_aio_update(conn, conn->mask | EPOLLOUT);
+}
+
+static void kx_aio_del_write(void *privdata) {
+    Kaioconn *conn = privdata;
+    kx_aio_update(conn, conn->mask & ~EPOLLOUT);
+}
+
+static void kx_aio_schedule_timer(void *privdata, struct timeval tv) {
+    Kaioconn *conn = privdata;
+    conn->timer_at = mstime() + tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Called by hiredis when it frees the context. */
+static void kx_aio_cleanup(void *privdata) {
+    Kaioconn *conn = privdata;
+
+    kx_aio_update(conn, 0);
+    conn->ac = NULL;
+    conn->connected = 0;
+    conn->timer_at = 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * Connections
+ *----------------------------------------------------------------------------*/
+
+static void kx_aio_failed(Kaioconn *conn) {
+    conn->failures++;
+    conn->retry_at = mstime() + kx_breaker_backoff(conn->failures) / 1000;
+}
+
+static void kx_aio_on_connect(const redisAsyncContext *ac, int status) {
+    Kaioconn *conn = ac->data;
+
+    if (status != REDIS_OK) {
+        /* hiredis frees the context after this callback. */
+        if (conn->failures == 0)
+            log_error("redis async failed connect (%s)", ac->errstr);
+        conn->ac = NULL;
+        kx_aio_failed(conn);
+        return;
+    }
+
+    if (conn->failures)
+        log_info("redis %s:%d reachable again", server.redisip, server.redisport);
+    conn->connected = 1;
+    conn->failures = 0;
+    redisKeepAlive((redisContext *)&ac->c, AIO_KEEPALIVE_INTERVAL);
+}
+
+static void kx_aio_on_disconnect(const redisAsyncContext *ac, int status) {
+    Kaioconn *conn = ac->data;
+
+    conn->ac = NULL;
+    conn->connected = 0;
+    if (status != REDIS_OK && !__atomic_load_n(&aio.stop, __ATOMIC_ACQUIRE)) {
+        /* Try again at once, back off only if that fails too. */
+        log_warn("redis async connection lost (%s)", ac->errstr);
+        conn->failures = 0;
+        conn->retry_at = 0;
+    }
+}
+
+static void kx_aio_connect(Kaioconn *conn) {
+    redisAsyncContext *ac;
+    redisOptions options = {0};
+    struct timeval connect_timeout = {1, 500000}; // 1.5 seconds
+    struct timeval command_timeout = {AIO_COMMAND_TIMEOUT, 0};
+
+    REDIS_OPTIONS_SET_TCP(&options, server.redisip, server.redisport);
+    options.connect_timeout = &connect_timeout;
+    options.command_timeout = &command_timeout;
+
+    ac = redisAsyncConnectWithOptions(&options);
+    if (ac == NULL || ac->err) {
+        if (ac) {
+            log_error("redis async failed connect (%s)", ac->errstr);
+            redisAsyncFree(ac);
+        } else {
+            log_error("redis Connection error: can't allocate redis context");
+        }
+        kx_aio_failed(conn);
+        return;
+    }
+
+    /* Replies are handed over to the workers, which free them. */
+    ac->c.flags |= REDIS_NO_AUTO_FREE_REPLIES;
+    ac->data = conn;
+    conn->ac = ac;
+    conn->fd = ac->c.fd;
+    conn->mask = 0;
+    conn->connected = 0;
+    conn->timer_at = 0;
+
+    ac->ev.data = conn;
+    ac->ev.addRead = kx_aio_add_read;
+    ac->ev.delRead = kx_aio_del_read;
+    ac->ev.addWrite = kx_aio_add_write;
+    ac->ev.delWrite = kx_aio_del_write;
+    ac->ev.cleanup = kx_aio_cleanup;
+    ac->ev.scheduleTimer = kx_aio_schedule_timer;
+
+    /* The connect callback is installed last: hiredis then waits for the
+     * socket to become writable to learn about the connection outcome. */
+    redisAsyncSetDisconnectCallback(ac, kx_aio_on_disconnect);
+    redisAsyncSetConnectCallback(ac, kx_aio_on_connect);
+}
+
+/* Next connected connection in round robin order, or NULL if none. */
+static Kaioconn *kx_aio_pick(void) {
+    for (int i = 0; i < aio.nconns; i++) {
+        Kaioconn *conn = &aio.conns[(aio.next + i) % aio.nconns];
+
+        if (conn->ac && conn->connected) {
+            aio.next = (aio.next + i + 1) % aio.nconns;
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Jobs
+ *----------------------------------------------------------------------------*/
+
+static void kx_aio_reply(redisAsyncContext *ac, void *r, void *privdata) {
+    Kaiojob *job = privdata;
+    UNUSED(ac);
+
+    /* A NULL reply means the connection went away with the command
+     * still in flight. */
+    if (r == NULL)
+        job->failed = 1;
+    else
+        job->replies[job->nreplies++] = r;
+
+    if (--job->pending == 0)
+        sem_post(&job->done);
+}
+
+/* Queue every command of the job on one connection, so that commands
+ * of a MULTI/EXEC block stay together. They are written out with the
+ * commands of other jobs the next time the socket is writable. */
+static void kx_aio_dispatch(Kaiojob *job) {
+    Kaioconn *conn = kx_aio_pick();
+
+    if (conn == NULL) {
+        /* No connection to redis, fail fast while reconnecting. */
+        job->failed = 1;
+        sem_post(&job->done);
+        return;
+    }
+
+    job->pending = job->ncmds;
+    for (int i = 0; i < job->ncmds; i++) {
+        if (redisAsyncFormattedCommand(conn->ac, kx_aio_reply, job,
+                                       job->cmds[i], job->lens[i]) != REDIS_OK) {
+            job->failed = 1;
+            job->pending -= job->ncmds - i;
+            if (job->pending == 0)
+                sem_post(&job->done);
+            return;
+        }
+    }
+}
+
+/* Take the queued jobs and dispatch them. */
+static void kx_aio_drain(void) {
+    Kaiojob *job, *next;
+    uint64_t n;
+
+    if (read(aio.wakefd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        log_error("redis async wakeup read failed: %s", strerror(errno));
+
+    pthread_mutex_lock(&aio.lock);
+    job = aio.head;
+    aio.head = aio.tail = NULL;
+    pthread_mutex_unlock(&aio.lock);
+
+    for (; job; job = next) {
+        next = job->next;
+        kx_aio_dispatch(job);
+    }
+}
+
+static void *kx_aio_main(void *arg) {
+    struct epoll_event events[AIO_MAX_EVENTS];
+    UNUSED(arg);
+
+    while (!__atomic_load_n(&aio.stop, __ATOMIC_ACQUIRE)) {
+        long long now = mstime(), wait = 1000;
+        int n;
+
+        for (int i = 0; i < aio.nconns; i++) {
+            Kaioconn *conn = &aio.conns[i];
+
+            if (conn->ac == NULL && now >= conn->retry_at)
+                kx_aio_connect(conn);
+            if (conn->ac && conn->timer_at && now >= conn->timer_at) {
+                conn->timer_at = 0;
+                redisAsyncHandleTimeout(conn->ac);
+            }
+
+            if (conn->ac == NULL && conn->retry_at - now < wait)
+                wait = conn->retry_at - now;
+            if (conn->ac && conn->timer_at && conn->timer_at - now < wait)
+                wait = conn->timer_at - now;
+        }
+        if (wait < 0)
+            wait = 0;
+
+        n = epoll_wait(aio.epfd, events, AIO_MAX_EVENTS, (int)wait);
+        for (int i = 0; i < n; i++) {
+            Kaioconn *conn = events[i].data.ptr;
+            int mask = events[i].events;
+
+            if (conn == NULL) {
+                kx_aio_drain();
+                continue;
+            }
+            /* The context may be freed by any of these calls. */
+            if (conn->ac && (mask & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                redisAsyncHandleRead(conn->ac);
+            if (conn->ac && (mask & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                redisAsyncHandleWrite(conn->ac);
+        }
+    }
+
+    /* Jobs queued before the stop request fail, as do the ones in
+     * flight when their connection is freed. */
+    kx_aio_drain();
+    for (int i = 0; i < aio.nconns; i++) {
+        if (aio.conns[i].ac)
+            redisAsyncFree(aio.conns[i].ac);
+    }
+    return NULL;
+}
+
+int kx_aio_start(int nconns) {
+    struct epoll_event ee = {0};
+
+    if (nconns <= 0)
+        nconns = 1;
+
+    aio.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (aio.epfd == -1) {
+        log_error("redis async epoll_create failed: %s", strerror(errno));
+        return -1;
+    }
+    aio.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (aio.wakefd == -1) {
+        log_error("redis async eventfd failed: %s", strerror(errno));
+        goto err;
+    }
+    ee.events = EPOLLIN;
+    ee.data.ptr = NULL;
+    if (epoll_ctl(aio.epfd, EPOLL_CTL_ADD, aio.wakefd, &ee) == -1) {
+        log_error("redis async epoll_ctl failed: %s", strerror(errno));
+        goto err;
+    }
+
+    aio.conns = zcalloc(sizeof(Kaioconn) * nconns);
+    aio.nconns = nconns;
+    aio.next = 0;
+    aio.stop = 0;
+    if (pthread_create(&aio.thread, NULL, kx_aio_main, NULL) != 0) {
+        log_error("redis async can't create I/O thread");
+        zfree(aio.conns);
+        aio.conns = NULL;
+        goto err;
+    }
+
+    pthread_mutex_lock(&aio.lock);
+    aio.running = 1;
+    pthread_mutex_unlock(&aio.lock);
+    log_info("redis async I/O thread started with %d connections", nconns);
+    return 0;
+
+err:
+    if (aio.wakefd != -1) close(aio.wakefd);
+    close(aio.epfd);
+    aio.wakefd = aio.epfd = -1;
+    return -1;
+}
+
+static void kx_aio_wakeup(void) {
+    uint64_t one = 1;
+
+    if (write(aio.wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        log_error("redis async wakeup write failed: %s", strerror(errno));
+}
+
+void kx_aio_stop(void) {
+    pthread_mutex_lock(&aio.lock);
+    if (!aio.running) {
+        pthread_mutex_unlock(&aio.lock);
+        return;
+    }
+    aio.running = 0;
+    __atomic_store_n(&aio.stop, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&aio.lock);
+
+    kx_aio_wakeup();
+    pthread_join(aio.thread, NULL);
+
+    zfree(aio.conns);
+    aio.conns = NULL;
+    aio.nconns = 0;
+    close(aio.wakefd);
+    close(aio.epfd);
+    aio.wakefd = aio.epfd = -1;
+}
+
+int kx_aio_execute(char **cmds, size_t *lens, int ncmds, redisReply **replies) {
+    Kaiojob job = {0};
+    int wake;
+
+    job.cmds = cmds;
+    job.lens = lens;
+    job.ncmds = ncmds;
+    job.replies = replies;
+    sem_init(&job.done, 0, 0);
+
+    pthread_mutex_lock(&aio.lock);
+    if (!aio.running) {
+        pthread_mutex_unlock(&aio.lock);
+        sem_destroy(&job.done);
+        return -1;
+    }
+    /* The I/O thread takes the whole queue at once, it only needs a
+     * wakeup when the queue goes from empty to non empty. */
+    wake = (aio.head == NULL);
+    if (aio.tail)
+        aio.tail->next = &job;
+    else
+        aio.head = &job;
+    aio.tail = &job;
+    pthread_mutex_unlock(&aio.lock);
+
+    if (wake)
+        kx_aio_wakeup();
+
+    while (sem_wait(&job.done) == -1 && errno == EINTR)
+        ;
+    sem_destroy(&job.done);
+
+    if (job.failed) {
+        for (int i = 0; i < job.nreplies; i++) {
+            freeReplyObject(replies[i]);
+            replies[i] = NULL;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+#define UNUSED(x) ((void)(x))
+
+int kx_aio_start(int nconns) {
+    UNUSED(nconns);
+    log_warn("redis-async needs epoll, which this platform lacks");
+    return -1;
+}
+
+void kx_aio_stop(void) {
+}
+
+int kx_aio_execute(char **cmds, size_t *lens, int ncmds, redisReply **replies) {
+    UNUSED(cmds);
+    UNUSED(lens);
+    UNUSED(ncmds);
+    UNUSED(replies);
+    return -1;
+}
+
+#endif
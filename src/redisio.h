@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __REDISIO__
+#define __REDISIO__
+
+/* Asynchronous redis backend.
+ *
+ * With 'redis-async yes' the blocking redisCommand calls made on the
+ * civetweb worker threads are replaced by a single I/O thread driving
+ * hiredis' async API over a few connections with epoll. Workers encode
+ * their commands, hand them to the I/O thread and sleep until the
+ * replies arrive, so the number of redis operations in flight is no
+ * longer limited by num_threads and commands from different workers
+ * are pipelined on the same connections automatically. */
+
+/** @brief Start the I/O thread and connect to redis.
+ * 
+ * @param nconns Number of redis connections to multiplex commands over
+ * @return Returns 0 on success, -1 if the backend is not available
+ */
+int kx_aio_start(int nconns);
+
+/** @brief Stop the I/O thread and close its connections. */
+void kx_aio_stop(void);
+
+/** @brief Send commands already encoded in the redis protocol and wait
+ *         for their replies. The commands go out back to back on one
+ *         connection, so a MULTI ... EXEC sequence stays together.
+ * 
+ * @param cmds Encoded commands (see redisFormatCommand)
+ * @param lens Length of every command
+ * @param ncmds Number of commands
+ * @param replies Receives one reply per command, owned by the caller
+ * @return Returns 0 on success, -1 if redis is unavailable or the
+ *         connection was lost before every reply arrived
+ */
+int kx_aio_execute(char **cmds, size_t *lens, int ncmds, redisReply **replies);
+
+#endif
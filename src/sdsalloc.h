@@ -36,7 +36,8 @@
  * the include of your alternate allocator if needed (not needed in order
  * to use the default libc allocator). */
 
-#include "zmalloc.h"
-#define s_malloc zmalloc
-#define s_realloc zrealloc
-#define s_free zfree
+/* Strings built while a request is handled live in the request arena */
+#include "arena.h"
+#define s_malloc kx_arena_malloc
+#define s_realloc kx_arena_realloc
+#define s_free kx_arena_free
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "traceid.h"
+
+#define TRACEID_TIME_SHIFT  (TRACEID_NODE_BITS + TRACEID_SEQ_BITS)
+
+/* Last identifier handed out, without the node bits: the time in the high
+ * bits and the sequence in the low TRACEID_SEQ_BITS, so that "next" is
+ * simply last + 1 when the clock did not move, or did move backward. */
+static uint64_t traceid_last = 0;
+static uint64_t traceid_node = 0;
+
+int kx_traceid_init(int node) {
+    if (node < 0 || node > TRACEID_NODE_MAX)
+        return -1;
+    traceid_node = (uint64_t)node << TRACEID_SEQ_BITS;
+    return 0;
+}
+
+uint64_t kx_traceid_next(long long ms) {
+    uint64_t last, next, now;
+
+    now = ms > TRACEID_EPOCH ? (uint64_t)(ms - TRACEID_EPOCH) << TRACEID_SEQ_BITS : 0;
+    last = __atomic_load_n(&traceid_last, __ATOMIC_RELAXED);
+    do {
+        next = now > last ? now : last + 1;
+    } while (!__atomic_compare_exchange_n(&traceid_last, &last, next, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return ((next >> TRACEID_SEQ_BITS) << TRACEID_TIME_SHIFT) |
+           traceid_node |
+           (next & ((1 << TRACEID_SEQ_BITS) - 1));
+}
+
+long long kx_traceid_ms(uint64_t id) {
+    return (long long)(id >> TRACEID_TIME_SHIFT) + TRACEID_EPOCH;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024-2024, Yanruibing <yanruibing@kxyk.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __TRACEID__
+#define __TRACEID__
+
+#include <stdint.h>
+
+/* Trace identifiers are 63 bit snowflake style numbers:
+ *
+ *   | 41 bits milliseconds since TRACEID_EPOCH | 10 bits node | 12 bits sequence |
+ *
+ * They grow with time on a node and never repeat as long as every
+ * kserver writing to the same redis has its own node_id. Up to 4096
+ * identifiers are handed out per millisecond, past that the generator
+ * borrows from the next millisecond rather than waiting for it. */
+#define TRACEID_EPOCH       1704067200000LL     /* 2024-01-01 00:00:00 UTC */
+#define TRACEID_NODE_BITS   10
+#define TRACEID_SEQ_BITS    12
+#define TRACEID_NODE_MAX    ((1 << TRACEID_NODE_BITS) - 1)
+
+/**
+ * @brief Set the node number embedded in the identifiers.
+ * 
+ * @param node 0 to TRACEID_NODE_MAX
+ * @return int 0 on success, -1 if the node is out of range
+ */
+int kx_traceid_init(int node);
+
+/**
+ * @brief Return a new identifier. Lock free, safe from any thread.
+ * 
+ * @param ms current time in milliseconds since the unix epoch
+ * @return uint64_t the identifier
+ */
+uint64_t kx_traceid_next(long long ms);
+
+/**
+ * @brief Milliseconds since the unix epoch at which an identifier was made.
+ */
+long long kx_traceid_ms(uint64_t id);
+
+#endif
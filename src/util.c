@@ -89,4 +89,17 @@ sds getAbsolutePath(char *filename) {
     abspath = sdscatsds(abspath,relpath);
     sdsfree(relpath);
     return abspath;
-}
\ No newline at end of file
+}
+
+/* 32 bit FNV-1a hash of len bytes at buf. Fast and well spread for
+ * the short keys (URIs, uuids) it is used on. */
+uint32_t fnv1aHash(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
@@ -28,6 +28,9 @@
 #ifndef __UTIL__
 #define __UTIL__
 
+#include <stdint.h>
+
 char *getAbsolutePath(char *filename);
+uint32_t fnv1aHash(const void *buf, size_t len);
 
 #endif
\ No newline at end of file
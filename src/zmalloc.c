@@ -323,6 +323,34 @@ int zmalloc_get_allocator_info(size_t *allocated,
     je_mallctl("stats.allocated", allocated, &sz, NULL, 0);
     return 1;
 }
+#elif defined(USE_TCMALLOC)
+int zmalloc_get_allocator_info(size_t *allocated,
+                               size_t *active,
+                               size_t *resident) {
+    size_t heap = 0, unmapped = 0, pagefree = 0;
+    *allocated = *resident = *active = 0;
+    MallocExtension_GetNumericProperty("generic.current_allocated_bytes", allocated);
+    MallocExtension_GetNumericProperty("generic.heap_size", &heap);
+    MallocExtension_GetNumericProperty("tcmalloc.pageheap_unmapped_bytes", &unmapped);
+    MallocExtension_GetNumericProperty("tcmalloc.pageheap_free_bytes", &pagefree);
+    /* The heap minus the pages given back to the system is what tcmalloc
+     * holds, minus its free pages what is in use or in thread caches. */
+    *resident = heap - unmapped;
+    *active = *resident - pagefree;
+    return 1;
+}
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+int zmalloc_get_allocator_info(size_t *allocated,
+                               size_t *active,
+                               size_t *resident) {
+    /* Summed over all the malloc arenas, which glibc creates up to eight
+     * per core as threads contend. Memory freed but kept by the arenas
+     * is the difference between resident and allocated. */
+    struct mallinfo2 mi = mallinfo2();
+    *allocated = *active = mi.uordblks + mi.hblkhd;
+    *resident = mi.arena + mi.hblkhd;
+    return 1;
+}
 #else
 int zmalloc_get_allocator_info(size_t *allocated,
                                size_t *active,
@@ -0,0 +1,32 @@
+import requests
+import json
+
+url = 'http://127.0.0.1:8099/filegettrace'
+
+def gettraces(encoding):
+    data = {
+        "uuid":"fileuuid7",
+        "page":0
+    }
+
+    json_data = json.dumps(data)
+
+    # requests inflates the body itself, the raw length is read from the header
+    response = requests.post(url, data=json_data,
+                             headers={'Content-Type': 'application/json',
+                                      'Accept-Encoding': encoding})
+
+    if response.status_code != 200:
+        print(f'Request failed with status code {response.status_code}')
+        print('Response:', response.text)
+        return None
+
+    coding = response.headers.get('Content-Encoding', 'identity')
+    print(f"{encoding:>8}: {coding:>8} {response.headers['Content-Length']:>8} bytes, "
+          f"{len(response.content)} uncompressed")
+    return response.json()
+
+if __name__ == "__main__":
+    plain = gettraces('identity')
+    assert gettraces('gzip') == plain
+    assert gettraces('deflate') == plain
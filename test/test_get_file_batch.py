@@ -0,0 +1,25 @@
+import requests
+import json
+
+def getfilebatch(uuids):
+    url = 'http://127.0.0.1:8099/fileget/batch'
+
+    data = {
+        "uuids":uuids
+    }
+
+    json_data = json.dumps(data)
+
+    response = requests.post(url, data=json_data, 
+                             headers={'Content-Type': 'application/json'})
+
+    if response.status_code == 200:
+        files = response.json()['files']
+        for uuid in uuids:
+            print(uuid, '->', files[uuid])
+    else:
+        print(f'Request failed with status code {response.status_code}')
+        print('Response:', response.text)
+
+if __name__ == "__main__":
+    getfilebatch(["fileuuid7", "fileuuid1", "nosuchfile"])
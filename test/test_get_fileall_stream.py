@@ -0,0 +1,35 @@
+import requests
+import json
+import time
+
+url = 'http://127.0.0.1:8099/filegetall/stream'
+
+def stream_files(machine):
+    data = {
+        "machine":machine
+    }
+
+    json_data = json.dumps(data)
+
+    start = time.time()
+    response = requests.post(url, data=json_data, stream=True,
+                             headers={'Content-Type': 'application/json'})
+
+    if response.status_code != 200:
+        print(f'Request failed with status code {response.status_code}')
+        print('Response:', response.text)
+        return
+
+    # The listing arrives in chunks, one per HSCAN call on the server
+    body = b''
+    chunks = 0
+    for chunk in response.iter_content(chunk_size=None):
+        body += chunk
+        chunks += 1
+
+    result = json.loads(body)
+    print(f"{len(result['files'])} files in {chunks} chunks, "
+          f"flag {result['flag']}, {time.time() - start:.2f}s")
+
+if __name__ == "__main__":
+    stream_files("f526255265340d994510f8d1652e1eb3")
@@ -0,0 +1,15 @@
+import requests
+
+# 目标 URL
+url = 'http://127.0.0.1:8099/metrics'  # 请替换为实际的服务器 URL
+
+# 发送 GET 请求
+response = requests.get(url)
+
+# 检查响应状态码
+if response.status_code == 200:
+    print('Request was successful')
+    print(response.text)
+else:
+    print(f'Request failed with status code {response.status_code}')
+    print('Response:', response.text)
@@ -0,0 +1,40 @@
+import requests
+import json
+import random
+import string
+
+def random_string(length):
+    letters_and_digits = string.ascii_lowercase + string.digits
+    return ''.join(random.choice(letters_and_digits) for i in range(length))
+
+def settracebatch(n):
+    url = 'http://127.0.0.1:8099/filesettrace/batch'
+
+    data = []
+    for i in range(n):
+        data.append({
+            "machine":"f526255265340d994510f8d1652e1eb3",
+            "uuid":f"fileuuid{i % 4}",
+            "username":random_string(11),
+            "time":"2024-05-23",
+            "action":0
+        })
+    # an invalid trace does not fail the others
+    data.append({"machine":"f526255265340d994510f8d1652e1eb3"})
+
+    json_data = json.dumps(data)
+
+    response = requests.post(url, data=json_data, 
+                             headers={'Content-Type': 'application/json'})
+
+    if response.status_code == 200:
+        results = response.json()['results']
+        ok = sum(1 for r in results if r['flag'] == 'OK')
+        print(f"Recorded {ok} of {len(results)} traces")
+        assert ok == n and results[-1]['flag'] == 'FAIL'
+    else:
+        print(f'Request failed with status code {response.status_code}')
+        print('Response:', response.text)
+
+if __name__ == "__main__":
+    settracebatch(100)
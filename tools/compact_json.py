@@ -0,0 +1,71 @@
+"""Rewrite pretty-printed JSON values stored by older kserver versions
+in compact form.
+
+kserver used to store file records as indented JSON. New records are
+written compact; this script converts the existing ones in place so
+they take less memory. It walks the filekey:* and machine:* hashes with
+SCAN/HSCAN, so it can run against a live server, and only rewrites a
+field whose value actually changes. Running it twice is harmless.
+
+usage: python3 compact_json.py [--host 127.0.0.1] [--port 6379] [--dry-run]
+"""
+import argparse
+import json
+
+import redis
+
+
+def compact(value):
+    try:
+        doc = json.loads(value)
+    except ValueError:
+        return None
+    return json.dumps(doc, separators=(',', ':'), ensure_ascii=False).encode()
+
+
+def migrate_hash(client, key, dry_run):
+    changed = 0
+    for field, value in client.hscan_iter(key, count=200):
+        new = compact(value)
+        if new is None or new == value:
+            continue
+        if not dry_run:
+            # Only overwrite if nobody updated the field meanwhile.
+            pipe = client.pipeline()
+            pipe.watch(key)
+            if pipe.hget(key, field) == value:
+                pipe.multi()
+                pipe.hset(key, field, new)
+                try:
+                    pipe.execute()
+                except redis.WatchError:
+                    continue
+            else:
+                pipe.reset()
+                continue
+        changed += 1
+    return changed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=6379)
+    parser.add_argument('--dry-run', action='store_true')
+    args = parser.parse_args()
+
+    client = redis.StrictRedis(host=args.host, port=args.port, db=0)
+
+    keys = fields = 0
+    for pattern in ('filekey:*', 'machine:*'):
+        for key in client.scan_iter(match=pattern, count=500, _type='hash'):
+            n = migrate_hash(client, key, args.dry_run)
+            if n:
+                keys += 1
+                fields += n
+
+    print(f"{'would rewrite' if args.dry_run else 'rewrote'} {fields} values in {keys} keys")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,105 @@
+"""Move file traces from the file hashes to their own sorted sets.
+
+kserver used to store the traces of a file as trace:<microseconds>
+fields of the filekey:<uuid> hash that also holds the file record.
+Traces now live in the sorted set trace:<uuid>, scored by the time they
+were recorded in milliseconds, start with their "id" and carry that time
+as "ts". This script moves the existing ones: every trace field is added
+to the sorted set and removed from the hash in one MULTI/EXEC, so it can
+run against a live server and be interrupted and restarted at any time.
+
+Moved traces get an id in the layout of src/traceid.h, made of their
+millisecond, the --node number and the microseconds within that
+millisecond as the sequence. It is the same for a field every time the
+script runs, and unique among the traces of a file since their fields
+are. Give a --node no kserver uses as node_id, the default being the
+last one.
+
+usage: python3 migrate_traces.py [--host 127.0.0.1] [--port 6379] [--node 1023]
+                                 [--dry-run] [--keep]
+"""
+import argparse
+import json
+
+import redis
+
+# src/traceid.h
+TRACEID_EPOCH = 1704067200000
+TRACEID_NODE_BITS = 10
+TRACEID_SEQ_BITS = 12
+TRACEID_NODE_MAX = (1 << TRACEID_NODE_BITS) - 1
+
+
+def trace_id(us, node):
+    """Trace id of a trace:<us> field, ids before TRACEID_EPOCH start at 0."""
+    ms = max(us // 1000 - TRACEID_EPOCH, 0)
+    return (ms << (TRACEID_NODE_BITS + TRACEID_SEQ_BITS)) | \
+        (node << TRACEID_SEQ_BITS) | (us % 1000)
+
+
+def trace_member(field, value, node):
+    """Score and compact member for a trace:<us> field, None if invalid."""
+    try:
+        us = int(field[len(b'trace:'):])
+        doc = json.loads(value)
+    except ValueError:
+        return None
+    if not isinstance(doc, dict):
+        return None
+    ms = us // 1000
+    # Like kx_trace_build: the id first, so that traces of the same
+    # millisecond sort by id, and the time last
+    doc.pop('id', None)
+    doc.pop('ts', None)
+    doc = {'id': str(trace_id(us, node)), **doc, 'ts': ms}
+    member = json.dumps(doc, separators=(',', ':'), ensure_ascii=False)
+    return ms, member.encode()
+
+
+def migrate_hash(client, key, node, dry_run, keep):
+    uuid = key[len(b'filekey:'):]
+    zkey = b'trace:' + uuid
+    moved = 0
+    for field, value in client.hscan_iter(key, match='trace:*', count=500):
+        entry = trace_member(field, value, node)
+        if entry is None:
+            print(f"skipping {key!r} {field!r}: not a trace")
+            continue
+        score, member = entry
+        if not dry_run:
+            pipe = client.pipeline(transaction=True)
+            pipe.zadd(zkey, {member: score})
+            if not keep:
+                pipe.hdel(key, field)
+            pipe.execute()
+        moved += 1
+    return moved
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=6379)
+    parser.add_argument('--node', type=int, default=TRACEID_NODE_MAX,
+                        help='node number of the ids of the moved traces')
+    parser.add_argument('--dry-run', action='store_true')
+    parser.add_argument('--keep', action='store_true',
+                        help='leave the old trace fields in the file hashes')
+    args = parser.parse_args()
+    if not 0 <= args.node <= TRACEID_NODE_MAX:
+        parser.error(f'--node must be from 0 to {TRACEID_NODE_MAX}')
+
+    client = redis.StrictRedis(host=args.host, port=args.port, db=0)
+
+    files = traces = 0
+    for key in client.scan_iter(match='filekey:*', count=500, _type='hash'):
+        n = migrate_hash(client, key, args.node, args.dry_run, args.keep)
+        if n:
+            files += 1
+            traces += n
+
+    print(f"{'would move' if args.dry_run else 'moved'} {traces} traces of {files} files")
+
+
+if __name__ == "__main__":
+    main()